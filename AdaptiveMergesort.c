@@ -1,10 +1,59 @@
 #include "net/coderodde/util/AdaptiveMergesort.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 
+/****************************************************************************
+* Internally all the comparators take a context argument. The comparators   *
+* of the context-free API are called through this adapter, with the context *
+* pointing to the actual comparator.                                        *
+****************************************************************************/
+static int compare_without_context(const void* a, const void* b, void* ctx)
+{
+    return (*(int (**)(const void*, const void*)) ctx)(a, b);
+}
+
+/****************************************************************************
+* Arrays no longer than this are sorted by insertion sort in the batch API. *
+****************************************************************************/
+#define INSERTION_SORT_THRESHOLD 16
+
+/****************************************************************************
+* Arrays no longer than this are sorted in the batch API by the ping-pong   *
+* mergesort over a shared per-thread buffer, without allocating any memory. *
+****************************************************************************/
+#define BATCH_MAX_PING_PONG_LENGTH 256
+
+/*****************************************************************************
+* The parameters of the presortedness sampling in 'adaptive_mergesort_auto'. *
+* The input is sorted by the interval merge only if the mean length of the   *
+* sampled runs is at least AUTO_MIN_MEAN_RUN_LENGTH and the fraction of the  *
+* sampled pairs that are out of order is at most AUTO_MAX_INVERSION_RATIO.   *
+* The windows alone may miss disorder at larger distances, for example in    *
+* many long interleaved runs.                                                *
+*****************************************************************************/
+#define AUTO_SAMPLE_WINDOWS 8
+#define AUTO_WINDOW_LENGTH 64
+#define AUTO_INVERSION_SAMPLES 64
+#define AUTO_MIN_MEAN_RUN_LENGTH 16
+#define AUTO_MAX_INVERSION_RATIO 0.1
+
+/***************************************************************************
+* The maximum number of pending runs in 'adaptive_mergesort_bounded'. Each *
+* pending run is more than twice as long as the run above it, so this is   *
+* enough for any array that fits in the memory.                            *
+***************************************************************************/
+#define BOUNDED_MAX_PENDING_RUNS (sizeof(size_t) * 8 + 1)
+
 /*****************************************************************************
 * This interval encodes an ascending contiguous sequence in the input array. *
 * The array from, from + 1, ..., to - 2, to - 1 is an ascending sorted       *
@@ -25,18 +74,77 @@ typedef struct run_t {
     interval_t* last_interval;
 } run_t;
 
-/********************************************
-* Allocates and initializes a new interval. *
-********************************************/
-static interval_t* interval_t_alloc(void* begin, void* end)
+/***************************************************************************
+* A pool of fixed-size nodes carved from one block of memory, used for the *
+* intervals and the runs when the caller provides the memory for them. A   *
+* NULL pool means that the nodes are allocated by 'malloc'.                *
+***************************************************************************/
+typedef struct node_pool_t {
+    char* memory;
+    size_t node_size;
+    size_t capacity;
+    size_t used;
+    void* free_list;
+} node_pool_t;
+
+/********************************************************************
+* Returns a node of at least 'size' bytes from 'node_pool', reusing *
+* the released nodes first.                                         *
+********************************************************************/
+static void* node_pool_t_acquire(node_pool_t* node_pool, size_t size)
 {
-    interval_t* result = malloc(sizeof *result);
+    void* node;
+    
+    if (!node_pool)
+    {
+        node = malloc(size);
+    }
+    else if (node_pool->free_list)
+    {
+        node = node_pool->free_list;
+        node_pool->free_list = *(void**) node;
+    }
+    else if (node_pool->used < node_pool->capacity)
+    {
+        node = node_pool->memory + node_pool->used++ * node_pool->node_size;
+    }
+    else
+    {
+        node = NULL;
+    }
     
-    if (!result)
+    if (!node)
     {
         abort();
     }
     
+    return node;
+}
+
+/**************************************
+* Returns 'node' back to 'node_pool'. *
+**************************************/
+static void node_pool_t_release(node_pool_t* node_pool, void* node)
+{
+    if (!node_pool)
+    {
+        free(node);
+        return;
+    }
+    
+    *(void**) node = node_pool->free_list;
+    node_pool->free_list = node;
+}
+
+/********************************************
+* Allocates and initializes a new interval. *
+********************************************/
+static interval_t* interval_t_alloc(node_pool_t* node_pool,
+                                    void* begin,
+                                    void* end)
+{
+    interval_t* result = node_pool_t_acquire(node_pool, sizeof *result);
+    
     result->begin = begin;
     result->end = end;
     return result;
@@ -45,15 +153,10 @@ static interval_t* interval_t_alloc(void* begin, void* end)
 /*****************************************************************************
 * Allocates and initializes a new run. It will consist of a single interval. *
 *****************************************************************************/
-static run_t* run_t_alloc(void* begin, void* end)
+static run_t* run_t_alloc(node_pool_t* node_pool, void* begin, void* end)
 {
-    interval_t* interval = interval_t_alloc(begin, end);
-    run_t* run = malloc(sizeof *run);
-    
-    if (!run)
-    {
-        abort();
-    }
+    interval_t* interval = interval_t_alloc(node_pool, begin, end);
+    run_t* run = node_pool_t_acquire(node_pool, sizeof *run);
     
     run->first_interval = interval;
     run->last_interval  = interval;
@@ -69,52 +172,43 @@ typedef struct run_queue_t {
     run_t** run_array;
     size_t head;
     size_t tail;
-    size_t mask;
+    size_t capacity;
     size_t size;
+    int owns_run_array;
 } run_queue_t;
 
-/******************************************************************************
-* Returns an integer whose only set bit is the highest order bit of 'number'. *
-******************************************************************************/
-static size_t highest_one_bit(size_t number)
+/*************************************************************************
+* Allocates a new empty run queue with room for 'capacity' runs. If      *
+* 'run_array' is NULL, the array of the runs is allocated too; otherwise *
+* 'run_array' must have room for 'capacity' runs, and is not owned by    *
+* the queue.                                                             *
+*************************************************************************/
+static run_queue_t* run_queue_t_alloc(size_t capacity, run_t** run_array)
 {
-    size_t result = 1;
+    run_queue_t* run_queue = malloc(sizeof *run_queue);
     
-    while (number >>= 1)
+    if (!run_queue)
     {
-        result <<= 1;
+        abort();
     }
     
-    return result;
-}
-
-/******************************************************************
-* Returns a smallest power of two that is not less than 'number'. *
-******************************************************************/
-static size_t ceil_to_power_of_two(size_t number)
-{
-    size_t result = highest_one_bit(number);
-    return result != number ? result << 1 : result;
-}
-
-/***********************************
-* Allocates a new empty run queue. *
-***********************************/
-static run_queue_t* run_queue_t_alloc(size_t capacity)
-{
-    run_queue_t* run_queue = malloc(sizeof *run_queue);
+    run_queue->owns_run_array = !run_array;
     
-    if (!run_queue)
+    if (!run_array)
     {
-        abort();
+        run_array = malloc((sizeof *run_array) * capacity);
+        
+        if (!run_array)
+        {
+            abort();
+        }
     }
     
-    capacity = ceil_to_power_of_two(capacity);
-    run_queue->mask = capacity - 1;
+    run_queue->capacity = capacity;
     run_queue->head = 0;
     run_queue->tail = 0;
     run_queue->size = 0;
-    run_queue->run_array = malloc((sizeof *run_queue->run_array) * capacity);
+    run_queue->run_array = run_array;
     return run_queue;
 }
 
@@ -123,8 +217,11 @@ static run_queue_t* run_queue_t_alloc(size_t capacity)
 ************************************************/
 static void run_queue_t_free(run_queue_t* run_queue)
 {
-    // TODO: Possibly free the only run.
-    free(run_queue->run_array);
+    if (run_queue->owns_run_array)
+    {
+        free(run_queue->run_array);
+    }
+    
     free(run_queue);
 }
 
@@ -134,7 +231,12 @@ static void run_queue_t_free(run_queue_t* run_queue)
 static void run_queue_t_enqueue(run_queue_t* run_queue, run_t* run)
 {
     run_queue->run_array[run_queue->tail] = run;
-    run_queue->tail = (run_queue->tail + 1) & run_queue->mask;
+    
+    if (++run_queue->tail == run_queue->capacity)
+    {
+        run_queue->tail = 0;
+    }
+    
     run_queue->size++;
 }
 
@@ -144,7 +246,8 @@ static void run_queue_t_enqueue(run_queue_t* run_queue, run_t* run)
 static void run_queue_t_add_to_last_run(run_queue_t* run_queue,
                                         size_t run_length)
 {
-    size_t index = (run_queue->tail - 1) & run_queue->mask;
+    size_t index = (run_queue->tail ? run_queue->tail : run_queue->capacity)
+                 - 1;
     run_queue->run_array[index]->first_interval->end += run_length;
 }
 
@@ -154,11 +257,27 @@ static void run_queue_t_add_to_last_run(run_queue_t* run_queue,
 static run_t* run_queue_t_dequeue(run_queue_t* run_queue)
 {
     run_t* run = run_queue->run_array[run_queue->head];
-    run_queue->head = (run_queue->head + 1) & run_queue->mask;
+    
+    if (++run_queue->head == run_queue->capacity)
+    {
+        run_queue->head = 0;
+    }
+    
     run_queue->size--;
     return run;
 }
 
+/*********************************************************
+* Removes all the runs from the run queue without        *
+* deallocating them.                                     *
+*********************************************************/
+static void run_queue_t_clear(run_queue_t* run_queue)
+{
+    run_queue->head = 0;
+    run_queue->tail = 0;
+    run_queue->size = 0;
+}
+
 /*********************************************************
 * Returns the number of runs currently in the run queue. *
 *********************************************************/
@@ -167,6 +286,28 @@ static size_t run_queue_t_size(run_queue_t* run_queue)
     return run_queue->size;
 }
 
+/************************************************************
+* The states of the run queue builder. Scanning a run and   *
+* reversing a descending run may both be suspended when the *
+* work budget runs out, and are resumed on the next step.   *
+************************************************************/
+enum {
+    BUILDER_NEW_RUN,
+    BUILDER_ASCENDING,
+    BUILDER_DESCENDING,
+    BUILDER_REVERSING,
+    BUILDER_DONE
+};
+
+/***********************************************************************
+* A range of the auxiliary array whose elements were reversed, and are *
+* therefore no longer where they were in the input array.              *
+***********************************************************************/
+typedef struct reversed_range_t {
+    void* begin;
+    void* end;
+} reversed_range_t;
+
 /**********************************************************************
 * This run queue builder is responsible for constructing a run queue. *
 **********************************************************************/
@@ -180,18 +321,51 @@ typedef struct run_queue_builder_t {
     void* right;
     void* last;
     void* aux;
+    void* reverse_begin;
+    void* reverse_end;
     int previous_run_was_descending;
-    int (*cmp)(const void*, const void*);
+    int state;
+    node_pool_t* node_pool;
+    reversed_range_t* reversed_ranges;
+    size_t reversed_range_count;
+    int (*cmp)(const void*, const void*, void*);
+    void* ctx;
 } run_queue_builder_t;
 
-/*************************************
-* Initializes the run queue builder. *
-*************************************/
+/**************************************************************************
+* Prepares the run queue builder for scanning a new range. The run queue  *
+* must have room for at least 'element_count' / 2 + 1 runs.               *
+**************************************************************************/
+static void run_queue_builder_t_reset(run_queue_builder_t* run_queue_builder,
+                                      void* base,
+                                      size_t element_count)
+{
+    size_t element_size = run_queue_builder->element_size;
+    
+    run_queue_t_clear(run_queue_builder->run_queue);
+    run_queue_builder->reversed_range_count = 0;
+    run_queue_builder->base = base;
+    run_queue_builder->element_count = element_count;
+    run_queue_builder->left = base;
+    run_queue_builder->right = base + element_size;
+    run_queue_builder->last = base + (element_count - 1) * element_size;
+    run_queue_builder->previous_run_was_descending = 0;
+    run_queue_builder->state = BUILDER_NEW_RUN;
+}
+
+/**********************************************************************
+* Initializes the run queue builder. The builder never produces more  *
+* than 'element_count' / 2 + 1 runs, since every run but the last one *
+* has at least two elements. If 'run_array' is not NULL, it must have *
+* room for that many runs, and the run queue is built in it.          *
+**********************************************************************/
 static run_queue_builder_t*
 run_queue_builder_t_alloc(void* base,
                           size_t element_count,
                           size_t element_size,
-                          int (*cmp)(const void*, const void*))
+                          run_t** run_array,
+                          int (*cmp)(const void*, const void*, void*),
+                          void* ctx)
 {
     run_queue_builder_t* run_queue_builder = malloc(sizeof *run_queue_builder);
     
@@ -207,210 +381,383 @@ run_queue_builder_t_alloc(void* base,
         abort();
     }
     
-    run_queue_builder->run_queue = run_queue_t_alloc(element_count);
-    run_queue_builder->base = base;
-    run_queue_builder->element_count = element_count;
+    run_queue_builder->run_queue = run_queue_t_alloc(element_count / 2 + 1,
+                                                     run_array);
+    run_queue_builder->node_pool = NULL;
+    run_queue_builder->reversed_ranges = NULL;
     run_queue_builder->element_size = element_size;
-    run_queue_builder->left = base;
-    run_queue_builder->right = base + element_size;
-    run_queue_builder->last = base + (element_count - 1) * element_size;
-    run_queue_builder->previous_run_was_descending = 0;
     run_queue_builder->cmp = cmp;
+    run_queue_builder->ctx = ctx;
+    run_queue_builder_t_reset(run_queue_builder, base, element_count);
     return run_queue_builder;
 }
 
-/*********************************************
-* Scans an ascending run in the input array. *
-*********************************************/
-static void run_queue_builder_t_scan_ascending_run(
-            run_queue_builder_t* run_queue_builder)
+/***********************************************************************
+* Deallocates the run queue builder. The run queue it has built is not *
+* deallocated, since it is owned by the caller.                        *
+***********************************************************************/
+static void run_queue_builder_t_free(run_queue_builder_t* run_queue_builder)
 {
-    void* left  = run_queue_builder->left;
-    void* right = run_queue_builder->right;
-    void* last  = run_queue_builder->last;
-    void* head  = run_queue_builder->head;
-    
-    int (*cmp)(const void*, const void*) = run_queue_builder->cmp;
-    run_queue_t* run_queue = run_queue_builder->run_queue;
+    free(run_queue_builder->aux);
+    free(run_queue_builder);
+}
+
+/***********************************************************************
+* Records that the range from 'begin' to 'end' has been reversed, if   *
+* the builder tracks the reversed ranges. A range that continues the   *
+* previous one extends it, so the ranges stay disjoint and in order.   *
+* There are at most 'element_count' / 2 of them, since every reversed  *
+* run has at least two elements.                                       *
+***********************************************************************/
+static void run_queue_builder_t_add_reversed_range(
+                                        run_queue_builder_t* run_queue_builder,
+                                        void* begin,
+                                        void* end)
+{
+    reversed_range_t* ranges = run_queue_builder->reversed_ranges;
+    size_t count = run_queue_builder->reversed_range_count;
     
-    size_t element_size = run_queue_builder->element_size;
-    run_t* run;
+    if (!ranges)
+    {
+        return;
+    }
     
-    while (left < last && cmp(left, right) <= 0)
+    if (count && ranges[count - 1].end == begin)
     {
-        left = right;
-        right += element_size;
+        ranges[count - 1].end = end;
+        return;
     }
     
-    if (run_queue_builder->previous_run_was_descending)
+    ranges[count].begin = begin;
+    ranges[count].end = end;
+    run_queue_builder->reversed_range_count++;
+}
+
+/***************************************************************************
+* Returns nonzero if the range from 'begin' to 'end' overlaps any of the   *
+* reversed ranges recorded by the builder.                                 *
+***************************************************************************/
+static int run_queue_builder_t_overlaps_reversed_range(
+                                        run_queue_builder_t* run_queue_builder,
+                                        void* begin,
+                                        void* end)
+{
+    reversed_range_t* ranges = run_queue_builder->reversed_ranges;
+    size_t low = 0;
+    size_t high = run_queue_builder->reversed_range_count;
+    size_t middle;
+    
+    /***************************************************************
+    * Find the first range that ends after 'begin'; only it may    *
+    * overlap the range, since the ranges are disjoint and sorted. *
+    ***************************************************************/
+    while (low < high)
     {
-        if (cmp(head - element_size, head) <= 0)
+        middle = low + (high - low) / 2;
+        
+        if (ranges[middle].end <= begin)
         {
-            run_queue_t_add_to_last_run(run_queue, right - head);
+            low = middle + 1;
         }
         else
         {
-            run = run_t_alloc(head, right);
-            run_queue_t_enqueue(run_queue, run);
+            high = middle;
         }
     }
-    else
-    {
-        run = run_t_alloc(head, right);
-        run_queue_t_enqueue(run_queue, run);
-    }
     
-    run_queue_builder->previous_run_was_descending = 0;
-    run_queue_builder->left = left;
-    run_queue_builder->right = right;
-    run_queue_builder->head = head;
+    return low < run_queue_builder->reversed_range_count
+        && ranges[low].begin < end;
 }
 
 /**************************************************************************
-* Reverses a strictly descending run into an ascending one. Strictness is *
-* required in order to keep the entire sorting algorithm stable.          *
+* Starts a new run at 'left'. Deals also with the single element run at   *
+* the very tail of the input array range. Returns the number of performed *
+* comparisons.                                                            *
 **************************************************************************/
-static void run_queue_builder_t_reverse_run(
-                                        run_queue_builder_t* run_queue_builder,
-                                        run_t* run)
+static size_t run_queue_builder_t_start_run(
+            run_queue_builder_t* run_queue_builder)
 {
+    int (*cmp)(const void*, const void*, void*) = run_queue_builder->cmp;
+    void* ctx = run_queue_builder->ctx;
     size_t element_size = run_queue_builder->element_size;
-    void* end = run->first_interval->end - element_size;
-    void* begin = run->first_interval->begin;
-    void* aux = run_queue_builder->aux;
+    void* last = run_queue_builder->last;
     
-    while (begin < end)
+    if (run_queue_builder->left < last)
     {
-        memcpy(aux, begin, element_size);
-        memcpy(begin, end, element_size);
-        memcpy(end, aux, element_size);
-        
-        begin += element_size;
-        end -= element_size;
+        run_queue_builder->head = run_queue_builder->left;
+    
+        if (cmp(run_queue_builder->left, run_queue_builder->right, ctx) <= 0)
+        {
+            run_queue_builder->state = BUILDER_ASCENDING;
+        }
+        else
+        {
+            run_queue_builder->state = BUILDER_DESCENDING;
+        }
+    
+        run_queue_builder->left = run_queue_builder->right;
+        run_queue_builder->right += element_size;
+        return 1;
+    }
+    
+    run_queue_builder->state = BUILDER_DONE;
+    
+    if (run_queue_builder->left != last)
+    {
+        return 0;
+    }
+    
+    /***************************************************************
+    * Deal with a single element run at the very tail of the input *
+    * array range.                                                 *
+    ***************************************************************/
+    if (cmp(last - element_size, last, ctx) <= 0)
+    {
+        run_queue_t_add_to_last_run(run_queue_builder->run_queue,
+                                    element_size);
     }
+    else
+    {
+        run_queue_t_enqueue(run_queue_builder->run_queue,
+                            run_t_alloc(run_queue_builder->node_pool,
+                                        last,
+                                        last + element_size));
+    }
+    
+    return 1;
 }
 
-/*********************************************
-* Scans a descending run in the input array. *
-*********************************************/
-static void run_queue_builder_t_scan_descending_run(
-            run_queue_builder_t* run_queue_builder)
+/***************************************************************************
+* Scans an ascending run in the input array. Performs at most 'budget'     *
+* comparisons in the scanning loop and returns the number of comparisons   *
+* actually made. If the budget runs out before the run ends, the scan will *
+* resume from the same position on the next call.                          *
+***************************************************************************/
+static size_t run_queue_builder_t_scan_ascending_run(
+            run_queue_builder_t* run_queue_builder,
+            size_t budget)
 {
     void* left  = run_queue_builder->left;
     void* right = run_queue_builder->right;
     void* last  = run_queue_builder->last;
     void* head  = run_queue_builder->head;
     
-    int (*cmp)(const void*, const void*) = run_queue_builder->cmp;
+    int (*cmp)(const void*, const void*, void*) = run_queue_builder->cmp;
+    void* ctx = run_queue_builder->ctx;
     run_queue_t* run_queue = run_queue_builder->run_queue;
     
     size_t element_size = run_queue_builder->element_size;
+    size_t work = 0;
     run_t* run;
     
-    while (left != last && cmp(left, right) > 0)
+    while (left < last)
     {
+        if (work == budget)
+        {
+            run_queue_builder->left = left;
+            run_queue_builder->right = right;
+            return work;
+        }
+    
+        ++work;
+    
+        if (cmp(left, right, ctx) > 0)
+        {
+            break;
+        }
+    
         left = right;
         right += element_size;
     }
     
     if (run_queue_builder->previous_run_was_descending)
     {
-        if (cmp(head - element_size, head) <= 0)
+        ++work;
+    
+        if (cmp(head - element_size, head, ctx) <= 0)
         {
             run_queue_t_add_to_last_run(run_queue, right - head);
         }
         else
         {
-            run = run_t_alloc(head, right);
-            run_queue_builder_t_reverse_run(run_queue_builder, run);
+            run = run_t_alloc(run_queue_builder->node_pool, head, right);
             run_queue_t_enqueue(run_queue, run);
         }
     }
     else
     {
-        run = run_t_alloc(head, right);
-        run_queue_builder_t_reverse_run(run_queue_builder, run);
+        run = run_t_alloc(run_queue_builder->node_pool, head, right);
         run_queue_t_enqueue(run_queue, run);
     }
     
-    run_queue_builder->previous_run_was_descending = 1;
-    run_queue_builder->left = left;
-    run_queue_builder->right = right;
-    run_queue_builder->head = head;
+    run_queue_builder->previous_run_was_descending = 0;
+    run_queue_builder->left = right;
+    run_queue_builder->right = right + element_size;
+    run_queue_builder->state = BUILDER_NEW_RUN;
+    return work;
 }
 
-void super(run_queue_t* run_queue, size_t element_size)
+/*********************************************
+* Scans a descending run in the input array. *
+*********************************************/
+static size_t run_queue_builder_t_scan_descending_run(
+            run_queue_builder_t* run_queue_builder,
+            size_t budget)
 {
-    run_t* run;
-    interval_t* interval;
-    void* shit;
+    void* left  = run_queue_builder->left;
+    void* right = run_queue_builder->right;
+    void* last  = run_queue_builder->last;
+    
+    int (*cmp)(const void*, const void*, void*) = run_queue_builder->cmp;
+    void* ctx = run_queue_builder->ctx;
+    
+    size_t element_size = run_queue_builder->element_size;
+    size_t work = 0;
     
-    while (run_queue_t_size(run_queue) > 0)
+    while (left < last)
     {
-        run = run_queue_t_dequeue(run_queue);
-        interval = run->first_interval;
-        
-        for (shit = interval->begin; shit < interval->end; shit += element_size)
+        if (work == budget)
         {
-            printf("%d ", **((int**)(shit)));
+            run_queue_builder->left = left;
+            run_queue_builder->right = right;
+            return work;
         }
-        
-        puts("");
+    
+        ++work;
+    
+        if (cmp(left, right, ctx) <= 0)
+        {
+            break;
+        }
+    
+        left = right;
+        right += element_size;
     }
+    
+    run_queue_builder->reverse_begin = run_queue_builder->head;
+    run_queue_builder->reverse_end = right - element_size;
+    run_queue_builder->left = right;
+    run_queue_builder->right = right + element_size;
+    run_queue_builder->state = BUILDER_REVERSING;
+    return work;
 }
 
-/***********************************************************
-* This function is responsible for building the run queue. *
-***********************************************************/
-static run_queue_t* run_queue_builder_t_run(
-                    run_queue_builder_t* run_queue_builder)
+/**************************************************************************
+* Reverses a strictly descending run into an ascending one. Strictness is *
+* required in order to keep the entire sorting algorithm stable. Performs *
+* at most 'budget' swaps, and once the whole run is reversed, appends it  *
+* to the run queue. Returns the amount of work done.                      *
+**************************************************************************/
+static size_t run_queue_builder_t_reverse_run(
+                                        run_queue_builder_t* run_queue_builder,
+                                        size_t budget)
 {
-    int (*cmp)(const void*, const void*) = run_queue_builder->cmp;
     size_t element_size = run_queue_builder->element_size;
-    void* last = run_queue_builder->last;
+    void* begin = run_queue_builder->reverse_begin;
+    void* end = run_queue_builder->reverse_end;
+    void* head = run_queue_builder->head;
+    void* aux = run_queue_builder->aux;
     
-    while (run_queue_builder->left < run_queue_builder->last)
+    int (*cmp)(const void*, const void*, void*) = run_queue_builder->cmp;
+    void* ctx = run_queue_builder->ctx;
+    run_queue_t* run_queue = run_queue_builder->run_queue;
+    
+    size_t work = 0;
+    
+    while (begin < end)
     {
-        run_queue_builder->head = run_queue_builder->left;
-        
-        if (cmp(run_queue_builder->left, run_queue_builder->right) <= 0) {
-            run_queue_builder->left = run_queue_builder->right;
-            run_queue_builder->right += element_size;
-            run_queue_builder_t_scan_ascending_run(run_queue_builder);
-        }
-        else
+        if (work == budget)
         {
-            run_queue_builder->left = run_queue_builder->right;
-            run_queue_builder->right += element_size;
-            run_queue_builder_t_scan_descending_run(run_queue_builder);
+            run_queue_builder->reverse_begin = begin;
+            run_queue_builder->reverse_end = end;
+            return work;
         }
-        
-        run_queue_builder->left = run_queue_builder->right;
-        run_queue_builder->right += element_size;
+    
+        memcpy(aux, begin, element_size);
+        memcpy(begin, end, element_size);
+        memcpy(end, aux, element_size);
+    
+        begin += element_size;
+        end -= element_size;
+        ++work;
     }
     
-    if (run_queue_builder->left == run_queue_builder->last)
+    run_queue_builder_t_add_reversed_range(run_queue_builder,
+                                           head,
+                                           run_queue_builder->left);
+    
+    /*************************************************************
+    * The run must be reversed before checking whether it may be *
+    * glued to the previous descending run.                      *
+    *************************************************************/
+    if (run_queue_builder->previous_run_was_descending)
     {
-        /***************************************************************
-        * Deal with a single element run at the very tail of the input *
-        * array range.                                                 *
-        ***************************************************************/
-        if (cmp(last - element_size, run_queue_builder->last) <= 0)
+        ++work;
+    
+        if (cmp(head - element_size, head, ctx) <= 0)
         {
-            run_queue_t_add_to_last_run(run_queue_builder->run_queue,
-                                        element_size);
+            run_queue_t_add_to_last_run(run_queue,
+                                        run_queue_builder->left - head);
         }
         else
         {
-            run_queue_t_enqueue(
-                        run_queue_builder->run_queue,
-                        run_t_alloc(run_queue_builder->left,
-                                    run_queue_builder->left + element_size));
+            run_queue_t_enqueue(run_queue,
+                                run_t_alloc(run_queue_builder->node_pool,
+                                            head,
+                                            run_queue_builder->left));
+        }
+    }
+    else
+    {
+        run_queue_t_enqueue(run_queue,
+                            run_t_alloc(run_queue_builder->node_pool,
+                                        head,
+                                        run_queue_builder->left));
+    }
+    
+    run_queue_builder->previous_run_was_descending = 1;
+    run_queue_builder->state = BUILDER_NEW_RUN;
+    return work;
+}
+
+/*************************************************************************
+* Builds the run queue, doing at most approximately 'budget' comparisons *
+* and element moves. Returns the amount of work done. The run queue is   *
+* complete once the builder reaches the state 'BUILDER_DONE'.            *
+*************************************************************************/
+static size_t run_queue_builder_t_step(run_queue_builder_t* run_queue_builder,
+                                       size_t budget)
+{
+    size_t work = 0;
+    
+    while (work < budget && run_queue_builder->state != BUILDER_DONE)
+    {
+        switch (run_queue_builder->state)
+        {
+            case BUILDER_NEW_RUN:
+                work += run_queue_builder_t_start_run(run_queue_builder);
+                break;
+    
+            case BUILDER_ASCENDING:
+                work += run_queue_builder_t_scan_ascending_run(
+                                                            run_queue_builder,
+                                                            budget - work);
+                break;
+    
+            case BUILDER_DESCENDING:
+                work += run_queue_builder_t_scan_descending_run(
+                                                            run_queue_builder,
+                                                            budget - work);
+                break;
+    
+            case BUILDER_REVERSING:
+                work += run_queue_builder_t_reverse_run(run_queue_builder,
+                                                        budget - work);
+                break;
         }
     }
     
-    super(run_queue_builder->run_queue, run_queue_builder->element_size);
-    return run_queue_builder->run_queue;
+    return work;
 }
 
 /*******************************************************************************
@@ -421,7 +768,8 @@ static void* upper_bound(void* base,
                          size_t num,
                          size_t size,
                          void* value,
-                         int (*cmp)(const void*, const void*))
+                         int (*cmp)(const void*, const void*, void*),
+                         void* ctx)
 {
     size_t count = num;
     size_t step;
@@ -432,8 +780,8 @@ static void* upper_bound(void* base,
         it = base;
         step = count >> 1;
         it += step * size;
-        
-        if (cmp(it, value) <= 0)
+    
+        if (cmp(it, value, ctx) <= 0)
         {
             base = it + size;
             count -= step + 1;
@@ -447,7 +795,7 @@ static void* upper_bound(void* base,
     return base;
     
 }
-                        
+
 /*******************************************************************************
 * Returns the pointer to the first element in the range which does not compare *
 * less than 'value'.                                                           *
@@ -456,7 +804,8 @@ static void* lower_bound(void* base,
                          size_t num,
                          size_t size,
                          void* value,
-                         int (*cmp)(const void*, const void*))
+                         int (*cmp)(const void*, const void*, void*),
+                         void* ctx)
 {
     size_t count = num;
     size_t step;
@@ -467,8 +816,8 @@ static void* lower_bound(void* base,
         it = base;
         step = count >> 1;
         it += step * size;
-        
-        if (cmp(it, value) < 0)
+    
+        if (cmp(it, value, ctx) < 0)
         {
             base = it + size;
             count -= step + 1;
@@ -482,54 +831,136 @@ static void* lower_bound(void* base,
     return base;
 }
 
+/****************************************************************************
+* Same as 'upper_bound', but gallops from the beginning of the range first. *
+* Assumes that the first element in the range does not compare greater      *
+* than 'value'.                                                             *
+****************************************************************************/
 static void* find_upper_bound(void* base,
                               size_t num,
                               size_t size,
                               void* value,
-                              int (*cmp)(const void*, const void*))
+                              int (*cmp)(const void*, const void*, void*),
+                              void* ctx)
 {
     size_t bound = 1;
     
-    while (bound < num && cmp(base + bound * size, value) < 0) {
+    while (bound < num && cmp(base + bound * size, value, ctx) <= 0) {
         bound <<= 1;
     }
     
     return upper_bound(base + (bound >> 1) * size,
-                       MIN(bound, num),
+                       MIN(bound + 1, num) - (bound >> 1),
                        size,
                        value,
-                       cmp);
+                       cmp,
+                       ctx);
 }
 
+/****************************************************************************
+* Same as 'lower_bound', but gallops from the beginning of the range first. *
+* Assumes that the first element in the range compares less than 'value'.   *
+****************************************************************************/
 static void* find_lower_bound(void* base,
                               size_t num,
                               size_t size,
                               void* value,
-                              int (*cmp)(const void*, const void*))
+                              int (*cmp)(const void*, const void*, void*),
+                              void* ctx)
 {
     size_t bound = 1;
     
-    while (bound < num && cmp(base + bound * size, value) < 0) {
+    while (bound < num && cmp(base + bound * size, value, ctx) < 0) {
         bound <<= 1;
     }
     
     return lower_bound(base + (bound >> 1) * size,
-                       MIN(bound, num),
+                       MIN(bound + 1, num) - (bound >> 1),
                        size,
                        value,
-                       cmp);
+                       cmp,
+                       ctx);
+}
+
+/******************************************************************************
+* This structure holds the state of a merge of two runs, so that the merge    *
+* may be suspended after any interval split and resumed later.                *
+******************************************************************************/
+typedef struct run_merger_t {
+    run_t* run1;
+    run_t* run2;
+    interval_t* head_interval_1;
+    interval_t* head_interval_2;
+    interval_t* merged_run_head;
+    interval_t* merged_run_tail;
+    size_t element_size;
+    node_pool_t* node_pool;
+    int (*cmp)(const void*, const void*, void*);
+    void* ctx;
+} run_merger_t;
+
+/**********************************************
+* Prepares 'run_merger' for merging two runs. *
+**********************************************/
+static void run_merger_t_init(run_merger_t* run_merger,
+                              run_t* run1,
+                              run_t* run2,
+                              size_t element_size,
+                              node_pool_t* node_pool,
+                              int (*cmp)(const void*, const void*, void*),
+                              void* ctx)
+{
+    run_merger->run1 = run1;
+    run_merger->run2 = run2;
+    run_merger->head_interval_1 = run1->first_interval;
+    run_merger->head_interval_2 = run2->first_interval;
+    run_merger->merged_run_head = NULL;
+    run_merger->merged_run_tail = NULL;
+    run_merger->element_size = element_size;
+    run_merger->node_pool = node_pool;
+    run_merger->cmp = cmp;
+    run_merger->ctx = ctx;
+}
+
+/****************************************************
+* Appends 'interval' to the tail of the merged run. *
+****************************************************/
+static void run_merger_t_append(run_merger_t* run_merger,
+                                interval_t* interval)
+{
+    if (run_merger->merged_run_head == NULL)
+    {
+        run_merger->merged_run_head = interval;
+        interval->prev = NULL;
+    }
+    else
+    {
+        run_merger->merged_run_tail->next = interval;
+        interval->prev = run_merger->merged_run_tail;
+    }
+    
+    run_merger->merged_run_tail = interval;
 }
 
-static run_t* merge(void* aux,
-                    size_t size,
-                    run_t* run1,
-                    run_t* run2,
-                    int (*cmp)(const void*, const void*))
+/*************************************************************
+* Returns nonzero if one of the two input runs is exhausted. *
+*************************************************************/
+static int run_merger_t_is_done(run_merger_t* run_merger)
 {
-    interval_t* head_interval_1 = run1->first_interval;
-    interval_t* head_interval_2 = run2->first_interval;
-    interval_t* merged_run_head = NULL;
-    interval_t* merged_run_tail = NULL;
+    return !run_merger->head_interval_1 || !run_merger->head_interval_2;
+}
+
+/***************************************************************************
+* Merges the two runs for at most approximately 'budget' comparisons.      *
+* Each interval step is charged two comparisons; the galloping search that *
+* splits an interval adds a number of comparisons logarithmic in the       *
+* length of the split interval. Returns the amount of work done.           *
+***************************************************************************/
+static size_t run_merger_t_step(run_merger_t* run_merger, size_t budget)
+{
+    size_t size = run_merger->element_size;
+    int (*cmp)(const void*, const void*, void*) = run_merger->cmp;
+    void* ctx = run_merger->ctx;
     
     void* head1;
     void* head2;
@@ -538,151 +969,534 @@ static run_t* merge(void* aux,
     void* cursor;
     
     size_t interval_length;
+    size_t work = 0;
+    interval_t* head_interval_1 = run_merger->head_interval_1;
+    interval_t* head_interval_2 = run_merger->head_interval_2;
     interval_t* new_interval;
-    interval_t* tmp_interval;
-    interval_t* next_interval;
     
-    while (head_interval_1 && head_interval_2)
+    while (head_interval_1 && head_interval_2 && work < budget)
     {
         head1 = head_interval_1->begin;
         head2 = head_interval_2->begin;
-        
-        if (cmp(head1, head2) <= 0)
+        work += 2;
+    
+        if (cmp(head1, head2, ctx) <= 0)
         {
             tail1 = head_interval_1->end - size;
-            
-            if (cmp(tail1, head2) <= 0)
+    
+            if (cmp(tail1, head2, ctx) <= 0)
             {
                 /*************************************************************
                 * Easy case, just append the right interval to the left one. *
                 *************************************************************/
-                if (merged_run_head == NULL)
-                {
-                    merged_run_head = head_interval_1;
-                    merged_run_tail = head_interval_1;
-                }
-                else
-                {
-                    merged_run_tail->next = head_interval_1;
-                    head_interval_1->prev = merged_run_tail;
-                    merged_run_tail = head_interval_1;
-                }
-                
+                run_merger_t_append(run_merger, head_interval_1);
                 head_interval_1 = head_interval_1->next;
                 continue;
             }
-            
+    
             /************************************************************
             * Cannot simply append. We need to split the left interval. *
             ************************************************************/
             interval_length = (head_interval_1->end - head_interval_1->begin)
                             / size;
-            
+    
             cursor = find_upper_bound(head_interval_1->begin,
                                       interval_length,
                                       size,
                                       head2,
-                                      cmp);
-                                      
-            new_interval = malloc(sizeof *new_interval);
-            new_interval->begin = head_interval_1->begin;
-            new_interval->end = cursor;
+                                      cmp,
+                                      ctx);
+    
+            new_interval = interval_t_alloc(run_merger->node_pool,
+                                            head_interval_1->begin, cursor);
             head_interval_1->begin = cursor;
-            
+    
             /***********************************************************
             * Append the split interval to the tail of the merged run. *
             ***********************************************************/
-            if (merged_run_head == NULL)
-            {
-                merged_run_head = new_interval;
-                merged_run_tail = new_interval;
-                new_interval->prev = NULL;
-                new_interval->next = NULL;
-            }
-            else
-            {
-                merged_run_tail->next = new_interval;
-                new_interval->prev = merged_run_tail;
-                new_interval->next = NULL;
-                merged_run_tail = new_interval;
-            }
+            new_interval->next = NULL;
+            run_merger_t_append(run_merger, new_interval);
         }
         else
         {
             tail2 = head_interval_2->end - size;
-            
-            if (cmp(tail2, head1) < 0)
+    
+            if (cmp(tail2, head1, ctx) < 0)
             {
                 /**************************************************************
                 * Easy case, just prepend the right interval to the beginning *
                 * of the left interval.                                       *
                 **************************************************************/
-                if (merged_run_head == NULL)
-                {
-                    merged_run_head = head_interval_2;
-                    merged_run_tail = head_interval_2;
-                }
-                else
-                {
-                    merged_run_tail->next = head_interval_2;
-                    head_interval_2->prev = merged_run_tail;
-                    merged_run_tail = head_interval_2;
-                }
-                
-                head_interval_2  = head_interval_2->next;
+                run_merger_t_append(run_merger, head_interval_2);
+                head_interval_2 = head_interval_2->next;
                 continue;
             }
-            
+    
             /*************************************************************
             * Cannot simply append. We need to split the right interval. *
             *************************************************************/
             interval_length = (head_interval_2->end - head_interval_2->begin)
                             / size;
-            
+    
             cursor = find_lower_bound(head_interval_2->begin,
                                       interval_length,
                                       size,
                                       head1,
-                                      cmp);
-            
-            new_interval = malloc(sizeof *new_interval);
-            new_interval->begin = head_interval_2->begin;
-            new_interval->end = cursor;
+                                      cmp,
+                                      ctx);
+    
+            new_interval = interval_t_alloc(run_merger->node_pool,
+                                            head_interval_2->begin, cursor);
             head_interval_2->begin = cursor;
-            
-            if (merged_run_head == NULL)
+            new_interval->next = NULL;
+            run_merger_t_append(run_merger, new_interval);
+        }
+    }
+    
+    run_merger->head_interval_1 = head_interval_1;
+    run_merger->head_interval_2 = head_interval_2;
+    return work;
+}
+
+/************************************************************************
+* Concatenates the rest of the nonexhausted run to the merged run and   *
+* returns the merged run. Must be called only after the merge is done.  *
+************************************************************************/
+static run_t* run_merger_t_finish(run_merger_t* run_merger)
+{
+    run_t* run1 = run_merger->run1;
+    run_t* run2 = run_merger->run2;
+    
+    if (run_merger->head_interval_1)
+    {
+        run_merger_t_append(run_merger, run_merger->head_interval_1);
+    }
+    else
+    {
+        run_merger_t_append(run_merger, run_merger->head_interval_2);
+        run1->last_interval = run2->last_interval;
+    }
+    
+    run1->first_interval = run_merger->merged_run_head;
+    
+    /*****************************************************************
+    * All the intervals of the second run are now owned by the first *
+    * run, so only the run record itself is deallocated.             *
+    *****************************************************************/
+    node_pool_t_release(run_merger->node_pool, run2);
+    return run1;
+}
+
+/*******************************************
+* The phases of a resumable adaptive sort. *
+*******************************************/
+enum {
+    SORT_COPY_IN,
+    SORT_SCAN,
+    SORT_MERGE,
+    SORT_COPY_OUT,
+    SORT_DONE
+};
+
+/******************************************************
+* This structure holds the state of a resumable sort. *
+******************************************************/
+struct adaptive_sort_state_t {
+    void* base;
+    size_t num;
+    size_t size;
+    int (*cmp)(const void*, const void*, void*);
+    void* ctx;
+    int (*plain_cmp)(const void*, const void*);
+    void* aux;
+    size_t capacity;
+    size_t elements_copied;
+    run_queue_builder_t* run_queue_builder;
+    run_queue_t* run_queue;
+    size_t runs_left;
+    int merging;
+    run_merger_t run_merger;
+    run_t* sorted_run;
+    interval_t* copy_interval;
+    void* copy_cursor;
+    void* copy_target;
+    node_pool_t* node_pool;
+    int skip_unchanged_writes;
+    size_t page_size;
+    int phase;
+};
+
+/****************************************************************
+* Copies at most 'budget' elements of the input array to 'aux'. *
+****************************************************************/
+static size_t adaptive_sort_copy_in(adaptive_sort_state_t* state,
+                                    size_t budget)
+{
+    size_t count = MIN(budget, state->num - state->elements_copied);
+    size_t offset = state->elements_copied * state->size;
+    
+    memcpy(state->aux + offset, state->base + offset, count * state->size);
+    state->elements_copied += count;
+    
+    if (state->elements_copied == state->num)
+    {
+        state->phase = SORT_SCAN;
+    }
+    
+    return count;
+}
+
+/**********************************************************************
+* Does at most approximately 'budget' work on building the run queue. *
+**********************************************************************/
+static size_t adaptive_sort_scan(adaptive_sort_state_t* state, size_t budget)
+{
+    size_t work = run_queue_builder_t_step(state->run_queue_builder, budget);
+    
+    if (state->run_queue_builder->state == BUILDER_DONE)
+    {
+        state->runs_left = run_queue_t_size(state->run_queue);
+        state->phase = SORT_MERGE;
+    }
+    
+    return work;
+}
+
+/**************************************************************************
+* Merges the runs pairwise, round by round, until only one run is left.   *
+* If a round has an odd number of runs, the last run is moved to the tail *
+* of the queue so that it takes part in the next round.                   *
+**************************************************************************/
+static size_t adaptive_sort_merge(adaptive_sort_state_t* state, size_t budget)
+{
+    run_queue_t* run_queue = state->run_queue;
+    run_t* run1;
+    run_t* run2;
+    size_t work;
+    
+    if (state->merging)
+    {
+        work = run_merger_t_step(&state->run_merger, budget);
+    
+        if (run_merger_t_is_done(&state->run_merger))
+        {
+            run_queue_t_enqueue(run_queue,
+                                run_merger_t_finish(&state->run_merger));
+            state->runs_left -= 2;
+            state->merging = 0;
+        }
+    
+        return work;
+    }
+    
+    if (run_queue_t_size(run_queue) < 2)
+    {
+        state->sorted_run = run_queue_t_dequeue(run_queue);
+        state->copy_interval = state->sorted_run->first_interval;
+        state->copy_cursor = state->copy_interval->begin;
+        state->copy_target = state->base;
+        state->phase = SORT_COPY_OUT;
+        return 0;
+    }
+    
+    switch (state->runs_left)
+    {
+        case 1:
+            run_queue_t_enqueue(run_queue, run_queue_t_dequeue(run_queue));
+            /****************
+            * FAll through! *
+            ****************/
+    
+        case 0:
+            state->runs_left = run_queue_t_size(run_queue);
+            return 0;
+    }
+    
+    run1 = run_queue_t_dequeue(run_queue);
+    run2 = run_queue_t_dequeue(run_queue);
+    run_merger_t_init(&state->run_merger,
+                      run1,
+                      run2,
+                      state->size,
+                      state->node_pool,
+                      state->cmp,
+                      state->ctx);
+    state->merging = 1;
+    return 0;
+}
+
+/*************************************************************************
+* Copies 'length' bytes from 'source' to 'target', skipping the chunks   *
+* of 'page_size' bytes of 'target' that already hold the same bytes.     *
+* Chunks are aligned to page boundaries, and comparing only reads the    *
+* target, so unchanged pages stay clean.                                 *
+*************************************************************************/
+static void copy_changed_bytes(void* target,
+                               void* source,
+                               size_t length,
+                               size_t page_size)
+{
+    size_t chunk_length;
+    
+    while (length)
+    {
+        chunk_length = MIN(length,
+                           page_size
+                           - (size_t)((uintptr_t) target % page_size));
+        
+        if (memcmp(target, source, chunk_length))
+        {
+            memcpy(target, source, chunk_length);
+        }
+        
+        target += chunk_length;
+        source += chunk_length;
+        length -= chunk_length;
+    }
+}
+
+/***********************************************************************
+* Copies at most 'budget' elements of the sorted run back to the input *
+* array, deallocating each interval as soon as it has been copied. If  *
+* unchanged writes are skipped, a piece of an interval that lies at    *
+* the same offset in 'aux' as its target in the input array, and that  *
+* does not overlap a reversed range, already holds the right data, so  *
+* it is skipped without even reading the target.                       *
+***********************************************************************/
+static size_t adaptive_sort_copy_out(adaptive_sort_state_t* state,
+                                     size_t budget)
+{
+    interval_t* interval = state->copy_interval;
+    interval_t* next_interval;
+    size_t size = state->size;
+    size_t work = 0;
+    size_t count;
+    
+    while (interval && work < budget)
+    {
+        count = MIN(budget - work,
+                    (size_t)(interval->end - state->copy_cursor) / size);
+    
+        if (state->skip_unchanged_writes)
+        {
+            if (state->copy_cursor - state->aux
+                != state->copy_target - state->base
+                || run_queue_builder_t_overlaps_reversed_range(
+                                                state->run_queue_builder,
+                                                state->copy_cursor,
+                                                state->copy_cursor
+                                                + count * size))
             {
-                merged_run_head = new_interval;
-                merged_run_tail = new_interval;
-                new_interval->prev = NULL;
-                new_interval->next = NULL;
+                copy_changed_bytes(state->copy_target,
+                                   state->copy_cursor,
+                                   count * size,
+                                   state->page_size);
             }
-            else
+        }
+        else
+        {
+            memcpy(state->copy_target, state->copy_cursor, count * size);
+        }
+        
+        state->copy_target += count * size;
+        state->copy_cursor += count * size;
+        work += count;
+    
+        if (state->copy_cursor == interval->end)
+        {
+            next_interval = interval->next;
+            node_pool_t_release(state->node_pool, interval);
+            interval = next_interval;
+    
+            if (interval)
             {
-                merged_run_tail->next = new_interval;
-                new_interval->prev = merged_run_tail;
-                new_interval->next = NULL;
-                merged_run_tail = new_interval;
+                state->copy_cursor = interval->begin;
             }
         }
     }
     
-    merged_run_tail->next = head_interval_1 ? head_interval_1 : head_interval_2;
-    merged_run_tail->next->prev = merged_run_tail;
-    merged_run_tail = merged_run_tail->next;
+    state->copy_interval = interval;
+    
+    if (!interval)
+    {
+        node_pool_t_release(state->node_pool, state->sorted_run);
+        state->sorted_run = NULL;
+        state->phase = SORT_DONE;
+    }
+    
+    return work;
+}
+
+/*****************************************************************
+* Allocates a sort state with no workspace for sorting arrays of *
+* elements of 'size' bytes.                                      *
+*****************************************************************/
+static adaptive_sort_state_t*
+adaptive_sort_state_t_alloc(size_t size,
+                            int (*cmp)(const void*, const void*, void*),
+                            void* ctx)
+{
+    adaptive_sort_state_t* state = malloc(sizeof *state);
+    
+    if (!state)
+    {
+        abort();
+    }
     
-    run1->first_interval = merged_run_head;
-    run1->last_interval = merged_run_tail;
+    state->size = size;
+    state->cmp = cmp;
+    state->ctx = ctx;
+    state->aux = NULL;
+    state->capacity = 0;
+    state->run_queue_builder = NULL;
+    state->run_queue = NULL;
+    state->node_pool = NULL;
+    state->skip_unchanged_writes = 0;
+    state->page_size = 0;
+    state->phase = SORT_DONE;
+    return state;
+}
+
+/**************************************************************************
+* Prepares the sort state for sorting the array 'base' of 'num' elements. *
+* The workspace of the previous sort is reused, and is grown only if it   *
+* is too small for 'num' elements.                                        *
+**************************************************************************/
+static void adaptive_sort_state_t_reset(adaptive_sort_state_t* state,
+                                        void* base,
+                                        size_t num)
+{
+    state->base = base;
+    state->num = num;
+    state->elements_copied = 0;
+    state->runs_left = 0;
+    state->merging = 0;
+    state->sorted_run = NULL;
+    state->copy_interval = NULL;
     
-    for (tmp_interval = run2->first_interval; tmp_interval;)
+    if (num < 2)
     {
-        next_interval = tmp_interval->next;
-        free(next_interval);
-        tmp_interval = next_interval;
+        state->phase = SORT_DONE;
+        return;
     }
     
-    free(run2);
-    return run1;
+    if (num > state->capacity)
+    {
+        free(state->aux);
+        state->aux = malloc(num * state->size);
+        
+        if (!state->aux)
+        {
+            abort();
+        }
+        
+        if (state->run_queue_builder)
+        {
+            run_queue_t_free(state->run_queue);
+            run_queue_builder_t_free(state->run_queue_builder);
+        }
+        
+        state->run_queue_builder = run_queue_builder_t_alloc(state->aux,
+                                                             num,
+                                                             state->size,
+                                                             NULL,
+                                                             state->cmp,
+                                                             state->ctx);
+        state->run_queue = state->run_queue_builder->run_queue;
+        state->capacity = num;
+    }
+    else
+    {
+        run_queue_builder_t_reset(state->run_queue_builder, state->aux, num);
+    }
+    
+    state->phase = SORT_COPY_IN;
+}
+
+/************************************************
+* Deallocates the sort state and its workspace. *
+************************************************/
+static void adaptive_sort_state_t_free(adaptive_sort_state_t* state)
+{
+    if (state->run_queue_builder)
+    {
+        run_queue_t_free(state->run_queue);
+        run_queue_builder_t_free(state->run_queue_builder);
+    }
+    
+    free(state->aux);
+    free(state);
+}
+
+adaptive_sort_state_t* adaptive_sort_begin_r(void* base,
+                                             size_t num,
+                                             size_t size,
+                                             int (*cmp)(const void*,
+                                                        const void*,
+                                                        void*),
+                                             void* ctx)
+{
+    adaptive_sort_state_t* state = adaptive_sort_state_t_alloc(size,
+                                                               cmp,
+                                                               ctx);
+    adaptive_sort_state_t_reset(state, base, num);
+    return state;
+}
+
+adaptive_sort_state_t* adaptive_sort_begin(void* base,
+                                           size_t num,
+                                           size_t size,
+                                           int (*cmp)(const void*,
+                                                      const void*))
+{
+    adaptive_sort_state_t* state =
+            adaptive_sort_state_t_alloc(size, compare_without_context, NULL);
+    
+    /*******************************************************************
+    * The state outlives this call, so it keeps the comparator itself. *
+    *******************************************************************/
+    state->plain_cmp = cmp;
+    state->ctx = &state->plain_cmp;
+    adaptive_sort_state_t_reset(state, base, num);
+    return state;
+}
+
+int adaptive_sort_step(adaptive_sort_state_t* state, size_t work_budget)
+{
+    size_t work = 0;
+    
+    while (work < work_budget && state->phase != SORT_DONE)
+    {
+        switch (state->phase)
+        {
+            case SORT_COPY_IN:
+                work += adaptive_sort_copy_in(state, work_budget - work);
+                break;
+    
+            case SORT_SCAN:
+                work += adaptive_sort_scan(state, work_budget - work);
+                break;
+    
+            case SORT_MERGE:
+                work += adaptive_sort_merge(state, work_budget - work);
+                break;
+    
+            case SORT_COPY_OUT:
+                work += adaptive_sort_copy_out(state, work_budget - work);
+                break;
+        }
+    }
+    
+    return state->phase == SORT_DONE;
+}
+
+void adaptive_sort_finish(adaptive_sort_state_t* state)
+{
+    while (!adaptive_sort_step(state, (size_t) -1))
+    {
+    }
+    
+    adaptive_sort_state_t_free(state);
 }
 
 void adaptive_mergesort(void* base,
@@ -690,51 +1504,1201 @@ void adaptive_mergesort(void* base,
                         size_t size,
                         int (*cmp)(const void*, const void*))
 {
-    interval_t* interval;
-    void* cursor;
-    void* aux = malloc(num * size);
-    memcpy(aux, base, num * size);
-    size_t runs_left;
-    run_t* run1;
-    run_t* run2;
-    run_t* merged_run;
-    run_queue_builder_t* run_queue_builder = run_queue_builder_t_alloc(aux,
-                                                                       num,
-                                                                       size,
-                                                                       cmp);
-    run_queue_t* run_queue = run_queue_builder_t_run(run_queue_builder);
-    runs_left = run_queue_t_size(run_queue);
-    
-    while (run_queue_t_size(run_queue) > 1)
-    {
-        switch (runs_left)
-        {
-            case 1:
-                run_queue_t_enqueue(run_queue, run_queue_t_dequeue(run_queue));
-                /****************
-                * FAll through! *
-                ****************/
-                
-            case 0:
-                runs_left = run_queue_t_size(run_queue);
-                continue;
+    adaptive_mergesort_r(base, num, size, compare_without_context, &cmp);
+}
+
+void adaptive_mergesort_r(void* base,
+                          size_t num,
+                          size_t size,
+                          int (*cmp)(const void*, const void*, void*),
+                          void* ctx)
+{
+    adaptive_sort_finish(adaptive_sort_begin_r(base, num, size, cmp, ctx));
+}
+
+/***************************************************************************
+* Copies one element of 'size' bytes. Elements of the size of the common   *
+* scalar types are copied with a constant size, which compiles to a single *
+* move instead of a library call per element.                              *
+***************************************************************************/
+static void copy_element(void* target, const void* source, size_t size)
+{
+    if (size == sizeof(uint32_t))
+    {
+        memcpy(target, source, sizeof(uint32_t));
+    }
+    else if (size == sizeof(uint64_t))
+    {
+        memcpy(target, source, sizeof(uint64_t));
+    }
+    else
+    {
+        memcpy(target, source, size);
+    }
+}
+
+/*************************************************************************
+* Sorts a short array by straight insertion sort. 'tmp' must have room   *
+* for one element. Stable, since each element is moved only past the     *
+* elements that compare greater than it. The small-array paths take the  *
+* context-free comparator and call it directly, as 'qsort' does, instead *
+* of going through 'compare_without_context'.                            *
+*************************************************************************/
+static void insertion_sort(void* base,
+                           size_t num,
+                           size_t size,
+                           void* tmp,
+                           int (*compar)(const void*, const void*))
+{
+    void* current;
+    void* hole;
+    size_t i;
+    
+    for (i = 1; i < num; ++i)
+    {
+        current = base + i * size;
+        
+        if (compar(current - size, current) <= 0)
+        {
+            continue;
+        }
+        
+        copy_element(tmp, current, size);
+        hole = current;
+        
+        do
+        {
+            copy_element(hole, hole - size, size);
+            hole -= size;
         }
+        while (hole > base && compar(hole - size, tmp) > 0);
         
-        run1 = run_queue_t_dequeue(run_queue);
-        run2 = run_queue_t_dequeue(run_queue);
-        merged_run = merge(aux, size, run1, run2, cmp);
-        run_queue_t_enqueue(run_queue, merged_run);
-        runs_left -= 2;
+        copy_element(hole, tmp, size);
     }
-    
-    for (interval = run_queue_t_dequeue(run_queue)->first_interval;
-         interval;
-         interval = interval->next)
+}
+
+/***********************************************************************
+* Merges the sorted ranges 'left' and 'right' into 'target'. Stable,   *
+* since on ties the element of the left range is taken first.          *
+***********************************************************************/
+static void merge_ranges(void* target,
+                         void* left,
+                         void* left_end,
+                         void* right,
+                         void* right_end,
+                         size_t size,
+                         int (*compar)(const void*, const void*))
+{
+    while (left < left_end && right < right_end)
     {
-        for (cursor = interval->begin; cursor != interval->end; ++cursor)
+        if (compar(right, left) < 0)
+        {
+            copy_element(target, right, size);
+            right += size;
+        }
+        else
         {
-            base = cursor;
-            base += size;
+            copy_element(target, left, size);
+            left += size;
         }
+        
+        target += size;
     }
+    
+    memcpy(target, left, left_end - left);
+    target += left_end - left;
+    memcpy(target, right, right_end - right);
+}
+
+/**************************************************************************
+* A plain bottom-up mergesort that moves the data between 'base' and      *
+* 'aux', alternating the roles of the two on each pass. 'aux' must have   *
+* room for 'num' elements. Blocks of INSERTION_SORT_THRESHOLD elements    *
+* are presorted by insertion sort, and two adjacent ranges that are       *
+* already in order are copied without merging. Allocates no memory.       *
+**************************************************************************/
+static void ping_pong_mergesort_with_buffer(void* base,
+                                            size_t num,
+                                            size_t size,
+                                            void* aux,
+                                            int (*compar)(const void*,
+                                                          const void*))
+{
+    void* source = base;
+    void* target = aux;
+    void* tmp;
+    void* end;
+    void* middle;
+    void* right_end;
+    void* left;
+    size_t width;
+    size_t i;
+    
+    for (i = 0; i < num; i += INSERTION_SORT_THRESHOLD)
+    {
+        insertion_sort(base + i * size,
+                       MIN(INSERTION_SORT_THRESHOLD, num - i),
+                       size,
+                       aux,
+                       compar);
+    }
+    
+    for (width = INSERTION_SORT_THRESHOLD; width < num; width <<= 1)
+    {
+        end = source + num * size;
+        
+        for (left = source; left < end; left = right_end)
+        {
+            middle = left + MIN(width * size, (size_t)(end - left));
+            right_end = middle + MIN(width * size, (size_t)(end - middle));
+            
+            if (middle == right_end || compar(middle - size, middle) <= 0)
+            {
+                memcpy(target + (left - source), left, right_end - left);
+                continue;
+            }
+            
+            merge_ranges(target + (left - source),
+                         left,
+                         middle,
+                         middle,
+                         right_end,
+                         size,
+                         compar);
+        }
+        
+        tmp = source;
+        source = target;
+        target = tmp;
+    }
+    
+    if (source != base)
+    {
+        memcpy(base, source, num * size);
+    }
+}
+
+/***************************************************************
+* Same as 'ping_pong_mergesort_with_buffer', but allocates the *
+* auxiliary buffer itself.                                     *
+***************************************************************/
+static void ping_pong_mergesort(void* base,
+                                size_t num,
+                                size_t size,
+                                int (*compar)(const void*, const void*))
+{
+    void* aux = malloc(num * size);
+    
+    if (!aux)
+    {
+        abort();
+    }
+    
+    ping_pong_mergesort_with_buffer(base, num, size, aux, compar);
+    free(aux);
+}
+
+/*********************************************************************
+* Describes a contiguous range of arrays sorted by one batch thread. *
+*********************************************************************/
+typedef struct batch_job_t {
+    void** bases;
+    const size_t* nums;
+    size_t from;
+    size_t to;
+    size_t size;
+    int (*compar)(const void*, const void*);
+} batch_job_t;
+
+/*************************************************************************
+* Sorts all the arrays of a batch job. The arrays of at most             *
+* BATCH_MAX_PING_PONG_LENGTH elements are sorted by insertion sort or by *
+* the ping-pong mergesort over one buffer shared by all the arrays, so   *
+* sorting them allocates no memory. Only the longer arrays go through    *
+* the interval merge, reusing one sort state for all of them.            *
+*************************************************************************/
+static void* batch_job_t_run(void* arg)
+{
+    batch_job_t* job = arg;
+    adaptive_sort_state_t* state = NULL;
+    size_t buffer_length = 1;
+    void* buffer;
+    size_t num;
+    size_t i;
+    
+    for (i = job->from; i < job->to; ++i)
+    {
+        num = MIN(job->nums[i], BATCH_MAX_PING_PONG_LENGTH);
+        buffer_length = num > buffer_length ? num : buffer_length;
+    }
+    
+    buffer = malloc(buffer_length * job->size);
+    
+    if (!buffer)
+    {
+        abort();
+    }
+    
+    for (i = job->from; i < job->to; ++i)
+    {
+        num = job->nums[i];
+        
+        if (num <= INSERTION_SORT_THRESHOLD)
+        {
+            insertion_sort(job->bases[i],
+                           num,
+                           job->size,
+                           buffer,
+                           job->compar);
+            continue;
+        }
+        
+        if (num <= BATCH_MAX_PING_PONG_LENGTH)
+        {
+            ping_pong_mergesort_with_buffer(job->bases[i],
+                                            num,
+                                            job->size,
+                                            buffer,
+                                            job->compar);
+            continue;
+        }
+        
+        if (!state)
+        {
+            state = adaptive_sort_state_t_alloc(job->size,
+                                                compare_without_context,
+                                                &job->compar);
+        }
+        
+        adaptive_sort_state_t_reset(state, job->bases[i], num);
+        
+        while (!adaptive_sort_step(state, (size_t) -1))
+        {
+        }
+    }
+    
+    free(buffer);
+    
+    if (state)
+    {
+        adaptive_sort_state_t_free(state);
+    }
+    
+    return NULL;
+}
+
+void adaptive_mergesort_batch(void** bases,
+                              const size_t* nums,
+                              size_t count,
+                              size_t size,
+                              int (*compar)(const void*, const void*),
+                              size_t nthreads)
+{
+    batch_job_t* jobs;
+    pthread_t* threads;
+    size_t total = 0;
+    size_t accumulated = 0;
+    size_t thread;
+    size_t i;
+    
+    for (i = 0; i < count; ++i)
+    {
+        total += nums[i];
+    }
+    
+    nthreads = MIN(nthreads, count);
+    
+    if (nthreads < 2)
+    {
+        batch_job_t job = { bases,
+                            nums,
+                            0,
+                            count,
+                            size,
+                            compar };
+        batch_job_t_run(&job);
+        return;
+    }
+    
+    jobs = malloc((sizeof *jobs) * nthreads);
+    threads = malloc((sizeof *threads) * nthreads);
+    
+    if (!jobs || !threads)
+    {
+        abort();
+    }
+    
+    /***********************************************************************
+    * Split the arrays into contiguous ranges of roughly equal total size. *
+    * The thread 'thread' takes the arrays until the running total reaches *
+    * (thread + 1) / nthreads of all the elements.                         *
+    ***********************************************************************/
+    i = 0;
+    
+    for (thread = 0; thread < nthreads; ++thread)
+    {
+        jobs[thread].bases = bases;
+        jobs[thread].nums = nums;
+        jobs[thread].size = size;
+        jobs[thread].compar = compar;
+        jobs[thread].from = i;
+        
+        while (i < count
+               && (thread == nthreads - 1
+                   || accumulated < total / nthreads * (thread + 1)))
+        {
+            accumulated += nums[i++];
+        }
+        
+        jobs[thread].to = i;
+        
+        if (pthread_create(&threads[thread],
+                           NULL,
+                           batch_job_t_run,
+                           &jobs[thread]))
+        {
+            abort();
+        }
+    }
+    
+    for (thread = 0; thread < nthreads; ++thread)
+    {
+        pthread_join(threads[thread], NULL);
+    }
+    
+    free(threads);
+    free(jobs);
+}
+
+/**************************************************************************
+* Counts the runs in the range the same way the run queue builder does: a *
+* run is either ascending or strictly descending. The number of elements  *
+* in the descending runs is added to 'descending_length'.                 *
+**************************************************************************/
+static size_t count_runs(void* base,
+                         size_t num,
+                         size_t size,
+                         int (*cmp)(const void*, const void*, void*),
+                         void* ctx,
+                         size_t* descending_length)
+{
+    void* left = base;
+    void* last = base + (num - 1) * size;
+    void* head;
+    size_t runs = 0;
+    
+    while (left < last)
+    {
+        ++runs;
+        
+        if (cmp(left, left + size, ctx) <= 0)
+        {
+            while (left < last && cmp(left, left + size, ctx) <= 0)
+            {
+                left += size;
+            }
+        }
+        else
+        {
+            head = left;
+            
+            while (left < last && cmp(left, left + size, ctx) > 0)
+            {
+                left += size;
+            }
+            
+            *descending_length += (size_t)(left - head) / size + 1;
+        }
+        
+        left += size;
+    }
+    
+    return left == last ? runs + 1 : runs;
+}
+
+/**************************************************************************
+* Estimates the presortedness of the input by scanning the runs in a few  *
+* evenly strided windows and by comparing pseudorandom pairs of elements. *
+* The pairs are checked against the direction that most of the sampled    *
+* elements run in, since the interval merge reverses the strictly         *
+* descending runs as cheaply as it takes the ascending ones.              *
+**************************************************************************/
+static void estimate_presortedness(void* base,
+                                   size_t num,
+                                   size_t size,
+                                   int (*cmp)(const void*, const void*, void*),
+                                   void* ctx,
+                                   adaptive_sort_stats_t* stats)
+{
+    size_t windows = AUTO_SAMPLE_WINDOWS;
+    size_t window_length = AUTO_WINDOW_LENGTH;
+    size_t sampled = 0;
+    size_t descending_length = 0;
+    size_t runs = 0;
+    size_t inversions = 0;
+    int descending;
+    int order;
+    uint64_t seed = num;
+    size_t stride;
+    size_t window;
+    size_t sample;
+    size_t i;
+    size_t j;
+    size_t tmp;
+    
+    if (num <= windows * window_length)
+    {
+        windows = 1;
+        window_length = num;
+    }
+    
+    stride = (num - window_length) / (windows > 1 ? windows - 1 : 1);
+    
+    for (window = 0; window < windows; ++window)
+    {
+        runs += count_runs(base + window * stride * size,
+                           window_length,
+                           size,
+                           cmp,
+                           ctx,
+                           &descending_length);
+        sampled += window_length;
+    }
+    
+    /*****************************************************************
+    * In a descending input, a pair is out of order unless its first *
+    * element is strictly greater, just as in a descending run.      *
+    *****************************************************************/
+    descending = 2 * descending_length > sampled;
+    
+    for (sample = 0; sample < AUTO_INVERSION_SAMPLES; ++sample)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        i = (seed >> 16) % num;
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        j = (seed >> 16) % num;
+        
+        if (i > j)
+        {
+            tmp = i;
+            i = j;
+            j = tmp;
+        }
+        
+        if (i == j)
+        {
+            continue;
+        }
+        
+        order = cmp(base + i * size, base + j * size, ctx);
+        
+        if (descending ? order <= 0 : order > 0)
+        {
+            ++inversions;
+        }
+    }
+    
+    stats->sampled_run_length = (double) sampled / runs;
+    stats->inversion_ratio = (double) inversions / AUTO_INVERSION_SAMPLES;
+}
+
+/***************************************************************************
+* A stable LSD radix sort by the 64-bit key of each element. The keys are  *
+* computed once and sorted together with the element indices, one byte per *
+* pass; passes in which all the keys share the same byte are skipped.      *
+* Finally, the elements are permuted into place through a buffer.          *
+***************************************************************************/
+static void radix_sort(void* base,
+                       size_t num,
+                       size_t size,
+                       uint64_t (*key)(const void*))
+{
+    uint64_t* keys = malloc((sizeof *keys) * num * 2);
+    size_t* indices = malloc((sizeof *indices) * num * 2);
+    void* aux = malloc(num * size);
+    uint64_t* key_source = keys;
+    uint64_t* key_target = keys + num;
+    size_t* index_source = indices;
+    size_t* index_target = indices + num;
+    size_t counts[256];
+    size_t shift;
+    size_t sum;
+    size_t bucket;
+    size_t i;
+    void* tmp;
+    
+    if (!keys || !indices || !aux)
+    {
+        abort();
+    }
+    
+    for (i = 0; i < num; ++i)
+    {
+        key_source[i] = key(base + i * size);
+        index_source[i] = i;
+    }
+    
+    for (shift = 0; shift < 64; shift += 8)
+    {
+        memset(counts, 0, sizeof counts);
+        
+        for (i = 0; i < num; ++i)
+        {
+            ++counts[(key_source[i] >> shift) & 0xff];
+        }
+        
+        if (counts[(key_source[0] >> shift) & 0xff] == num)
+        {
+            continue;
+        }
+        
+        for (bucket = 0, sum = 0; bucket < 256; ++bucket)
+        {
+            i = counts[bucket];
+            counts[bucket] = sum;
+            sum += i;
+        }
+        
+        for (i = 0; i < num; ++i)
+        {
+            bucket = (key_source[i] >> shift) & 0xff;
+            key_target[counts[bucket]] = key_source[i];
+            index_target[counts[bucket]++] = index_source[i];
+        }
+        
+        tmp = key_source;
+        key_source = key_target;
+        key_target = tmp;
+        tmp = index_source;
+        index_source = index_target;
+        index_target = tmp;
+    }
+    
+    for (i = 0; i < num; ++i)
+    {
+        memcpy(aux + i * size, base + index_source[i] * size, size);
+    }
+    
+    memcpy(base, aux, num * size);
+    free(aux);
+    free(indices);
+    free(keys);
+}
+
+void adaptive_mergesort_auto(void* base,
+                             size_t num,
+                             size_t size,
+                             int (*compar)(const void*, const void*),
+                             uint64_t (*key)(const void*),
+                             adaptive_sort_stats_t* stats)
+{
+    int (*cmp)(const void*, const void*, void*) = compare_without_context;
+    void* ctx = &compar;
+    adaptive_sort_stats_t local_stats;
+    
+    if (!stats)
+    {
+        stats = &local_stats;
+    }
+    
+    stats->sampled_run_length = (double) num;
+    stats->inversion_ratio = 0.0;
+    stats->strategy = ADAPTIVE_SORT_INTERVAL_MERGE;
+    
+    if (num < 2)
+    {
+        return;
+    }
+    
+    estimate_presortedness(base, num, size, cmp, ctx, stats);
+    
+    if (stats->sampled_run_length >= AUTO_MIN_MEAN_RUN_LENGTH
+        && stats->inversion_ratio <= AUTO_MAX_INVERSION_RATIO)
+    {
+        adaptive_mergesort_r(base, num, size, cmp, ctx);
+    }
+    else if (key)
+    {
+        stats->strategy = ADAPTIVE_SORT_RADIX;
+        radix_sort(base, num, size, key);
+    }
+    else
+    {
+        stats->strategy = ADAPTIVE_SORT_PING_PONG_MERGE;
+        ping_pong_mergesort(base, num, size, compar);
+    }
+}
+
+/**************************************************************
+* Swaps the 'size' bytes at 'a' with the 'size' bytes at 'b'. *
+**************************************************************/
+static void swap_bytes(char* a, char* b, size_t size)
+{
+    char tmp;
+    
+    while (size--)
+    {
+        tmp = *a;
+        *a++ = *b;
+        *b++ = tmp;
+    }
+}
+
+/*******************************************************************
+* Reverses the range 'begin', ..., 'end' - 1 of elements in place. *
+*******************************************************************/
+static void reverse_range(void* begin, void* end, size_t size)
+{
+    end -= size;
+    
+    while (begin < end)
+    {
+        swap_bytes(begin, end, size);
+        begin += size;
+        end -= size;
+    }
+}
+
+/*************************************************************************
+* Rotates the range 'begin', ..., 'end' - 1 in place so that the element *
+* at 'middle' becomes the first one.                                     *
+*************************************************************************/
+static void rotate_range(void* begin, void* middle, void* end, size_t size)
+{
+    reverse_range(begin, middle, size);
+    reverse_range(middle, end, size);
+    reverse_range(begin, end, size);
+}
+
+/************************************************************************
+* Merges the adjacent sorted ranges 'base[lo, mid)' and 'base[mid, hi)' *
+* through 'buffer', which must have room for the shorter of the two.    *
+************************************************************************/
+static void buffer_merge(void* base,
+                         size_t lo,
+                         size_t mid,
+                         size_t hi,
+                         size_t size,
+                         void* buffer,
+                         int (*cmp)(const void*, const void*, void*),
+                         void* ctx)
+{
+    void* left = base + lo * size;
+    void* middle = base + mid * size;
+    void* right = base + hi * size;
+    void* buffer_end;
+    
+    if (mid - lo <= hi - mid)
+    {
+        /*************************************************************
+        * Move the left range to the buffer and merge from the left. *
+        * On ties the element of the left range goes to the front.   *
+        * Once the buffer runs out, the rest of the right range is   *
+        * already in place.                                          *
+        *************************************************************/
+        memcpy(buffer, left, middle - left);
+        buffer_end = buffer + (middle - left);
+        
+        while (buffer < buffer_end && middle < right)
+        {
+            if (cmp(middle, buffer, ctx) < 0)
+            {
+                memcpy(left, middle, size);
+                middle += size;
+            }
+            else
+            {
+                memcpy(left, buffer, size);
+                buffer += size;
+            }
+            
+            left += size;
+        }
+        
+        memcpy(left, buffer, buffer_end - buffer);
+        return;
+    }
+    
+    /***************************************************************
+    * Move the right range to the buffer and merge from the right. *
+    * On ties the element of the right range goes to the back.     *
+    ***************************************************************/
+    memcpy(buffer, middle, right - middle);
+    buffer_end = buffer + (right - middle);
+    
+    while (buffer < buffer_end && left < middle)
+    {
+        right -= size;
+        
+        if (cmp(buffer_end - size, middle - size, ctx) < 0)
+        {
+            middle -= size;
+            memcpy(right, middle, size);
+        }
+        else
+        {
+            buffer_end -= size;
+            memcpy(right, buffer_end, size);
+        }
+    }
+    
+    memcpy(right - (buffer_end - buffer), buffer, buffer_end - buffer);
+}
+
+/**************************************************************************
+* Stably merges the adjacent sorted ranges 'base[a, m)' and 'base[m, b)'. *
+* If the shorter range fits in the buffer of 'buffer_capacity' elements,  *
+* merges through the buffer. Otherwise splits the problem by the SymMerge *
+* algorithm of Kim and Kutzner, which rotates the middle part of the two  *
+* ranges in place and recurses on two smaller merges.                     *
+**************************************************************************/
+static void sym_merge(void* base,
+                      size_t a,
+                      size_t m,
+                      size_t b,
+                      size_t size,
+                      void* buffer,
+                      size_t buffer_capacity,
+                      int (*cmp)(const void*, const void*, void*),
+                      void* ctx)
+{
+    size_t mid;
+    size_t n;
+    size_t start;
+    size_t r;
+    size_t c;
+    size_t end;
+    void* cursor;
+    
+    if (MIN(m - a, b - m) <= buffer_capacity)
+    {
+        buffer_merge(base, a, m, b, size, buffer, cmp, ctx);
+        return;
+    }
+    
+    if (m - a == 1)
+    {
+        cursor = lower_bound(base + m * size, b - m, size, base + a * size,
+                             cmp,
+                             ctx);
+        rotate_range(base + a * size, base + m * size, cursor, size);
+        return;
+    }
+    
+    if (b - m == 1)
+    {
+        cursor = upper_bound(base + a * size, m - a, size, base + m * size,
+                             cmp,
+                             ctx);
+        rotate_range(cursor, base + m * size, base + b * size, size);
+        return;
+    }
+    
+    mid = a + (b - a) / 2;
+    n = mid + m;
+    
+    if (m > mid)
+    {
+        start = n - b;
+        r = mid;
+    }
+    else
+    {
+        start = a;
+        r = m;
+    }
+    
+    while (start < r)
+    {
+        c = start + (r - start) / 2;
+        
+        if (cmp(base + (n - 1 - c) * size, base + c * size, ctx) >= 0)
+        {
+            start = c + 1;
+        }
+        else
+        {
+            r = c;
+        }
+    }
+    
+    end = n - start;
+    
+    if (start < m && m < end)
+    {
+        rotate_range(base + start * size,
+                     base + m * size,
+                     base + end * size,
+                     size);
+    }
+    
+    if (a < start && start < mid)
+    {
+        sym_merge(base, a, start, mid, size, buffer, buffer_capacity, cmp, ctx);
+    }
+    
+    if (mid < end && end < b)
+    {
+        sym_merge(base, mid, end, b, size, buffer, buffer_capacity, cmp, ctx);
+    }
+}
+
+/************************************************************************
+* The merge buffer of 'adaptive_mergesort_bounded'. The buffer is grown *
+* only when a merge actually needs it, up to 'capacity' elements, so    *
+* 'length' is the actual peak size of the buffer in elements.           *
+************************************************************************/
+typedef struct bounded_buffer_t {
+    void* memory;
+    size_t length;
+    size_t capacity;
+} bounded_buffer_t;
+
+/**************************************************************************
+* Merges the adjacent sorted ranges 'base[lo, mid)' and 'base[mid, hi)'.  *
+* First trims the elements that are already in place from both ends, so   *
+* that presorted data costs only two searches.                            *
+**************************************************************************/
+static void bounded_merge(void* base,
+                          size_t lo,
+                          size_t mid,
+                          size_t hi,
+                          size_t size,
+                          bounded_buffer_t* buffer,
+                          int (*cmp)(const void*, const void*, void*),
+                          void* ctx)
+{
+    size_t needed;
+    
+    lo = (upper_bound(base + lo * size,
+                      mid - lo,
+                      size,
+                      base + mid * size,
+                      cmp,
+                      ctx) - base) / size;
+    
+    if (lo == mid)
+    {
+        return;
+    }
+    
+    hi = (lower_bound(base + mid * size,
+                      hi - mid,
+                      size,
+                      base + (mid - 1) * size,
+                      cmp,
+                      ctx) - base) / size;
+    
+    needed = MIN(buffer->capacity, MIN(mid - lo, hi - mid));
+    
+    if (needed > buffer->length)
+    {
+        free(buffer->memory);
+        buffer->memory = malloc(needed * size);
+        
+        if (!buffer->memory)
+        {
+            abort();
+        }
+        
+        buffer->length = needed;
+    }
+    
+    sym_merge(base,
+              lo,
+              mid,
+              hi,
+              size,
+              buffer->memory,
+              buffer->length,
+              cmp,
+              ctx);
+}
+
+void adaptive_mergesort_bounded(void* base,
+                                size_t num,
+                                size_t size,
+                                int (*compar)(const void*, const void*),
+                                size_t max_aux_bytes,
+                                size_t* peak_aux_bytes)
+{
+    int (*cmp)(const void*, const void*, void*) = compare_without_context;
+    void* ctx = &compar;
+    size_t run_begin[BOUNDED_MAX_PENDING_RUNS];
+    size_t run_length[BOUNDED_MAX_PENDING_RUNS];
+    size_t runs = 0;
+    bounded_buffer_t buffer = { NULL, 0, MIN(max_aux_bytes / size, num / 2) };
+    void* cursor;
+    size_t lo = 0;
+    size_t hi;
+    size_t forced_hi;
+    
+    while (lo < num)
+    {
+        /******************************************************************
+        * Scan the next natural run, reversing it if strictly descending. *
+        ******************************************************************/
+        hi = lo + 1;
+        
+        if (hi < num && cmp(base + lo * size, base + hi * size, ctx) <= 0)
+        {
+            while (hi < num
+                   && cmp(base + (hi - 1) * size, base + hi * size, ctx) <= 0)
+            {
+                ++hi;
+            }
+        }
+        else
+        {
+            while (hi < num
+                   && cmp(base + (hi - 1) * size, base + hi * size, ctx) > 0)
+            {
+                ++hi;
+            }
+            
+            reverse_range(base + lo * size, base + hi * size, size);
+        }
+        
+        /*********************************************************
+        * Extend short runs by insertion sort so that the number *
+        * of the runs stays small on random data.                *
+        *********************************************************/
+        forced_hi = MIN(num, lo + INSERTION_SORT_THRESHOLD);
+        
+        for (; hi < forced_hi; ++hi)
+        {
+            cursor = upper_bound(base + lo * size,
+                                 hi - lo,
+                                 size,
+                                 base + hi * size,
+                                 cmp,
+                                 ctx);
+            rotate_range(cursor,
+                         base + hi * size,
+                         base + (hi + 1) * size,
+                         size);
+        }
+        
+        run_begin[runs] = lo;
+        run_length[runs++] = hi - lo;
+        lo = hi;
+        
+        /******************************************************************
+        * Keep every pending run more than twice as long as the one above *
+        * it, so that the stack stays logarithmic in depth.               *
+        ******************************************************************/
+        while (runs > 1
+               && (lo == num
+                   || run_length[runs - 2] <= 2 * run_length[runs - 1]))
+        {
+            bounded_merge(base,
+                          run_begin[runs - 2],
+                          run_begin[runs - 1],
+                          run_begin[runs - 1] + run_length[runs - 1],
+                          size,
+                          &buffer,
+                          cmp,
+                          ctx);
+            run_length[runs - 2] += run_length[runs - 1];
+            --runs;
+        }
+    }
+    
+    if (peak_aux_bytes)
+    {
+        *peak_aux_bytes = buffer.length * size;
+    }
+    
+    free(buffer.memory);
+}
+
+/************************************************************************
+* Maps 'length' bytes of anonymous memory for the auxiliary array, and  *
+* asks the kernel to back it by huge pages where transparent huge pages *
+* are available. No swap is reserved up front, since only the touched   *
+* pages are ever used. Returns MAP_FAILED on failure.                   *
+************************************************************************/
+static void* map_auxiliary_memory(size_t length)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* aux;
+    
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    
+    aux = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    
+#ifdef MADV_HUGEPAGE
+    if (aux != MAP_FAILED)
+    {
+        madvise(aux, length, MADV_HUGEPAGE);
+    }
+#endif
+    
+    return aux;
+}
+
+int adaptive_mergesort_mmap(const char* path,
+                            size_t record_size,
+                            int (*compar)(const void*, const void*))
+{
+    adaptive_sort_state_t* state;
+    struct stat file_status;
+    node_pool_t node_pool;
+    size_t length;
+    size_t num;
+    size_t run_array_length;
+    size_t node_pool_length;
+    size_t reversed_ranges_length;
+    void* base;
+    void* aux;
+    void* run_array;
+    void* reversed_ranges;
+    int saved_errno;
+    int fd = open(path, O_RDWR);
+    
+    if (fd < 0)
+    {
+        return -1;
+    }
+    
+    if (fstat(fd, &file_status))
+    {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    length = (size_t) file_status.st_size;
+    
+    if (record_size == 0 || length % record_size)
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    num = length / record_size;
+    
+    if (num < 2)
+    {
+        return close(fd);
+    }
+    
+    base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    
+    if (base == MAP_FAILED)
+    {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    /**********************************************************************
+    * The run queue, the interval and run nodes, and the reversed ranges  *
+    * live in anonymous memory next to the auxiliary array, so that the   *
+    * sort does not touch the heap. There are at most 'num' intervals,    *
+    * 'num' / 2 + 1 runs and 'num' / 2 reversed ranges at any time, and a *
+    * run node fits in an interval node.                                  *
+    **********************************************************************/
+    run_array_length = (num / 2 + 1) * sizeof(run_t*);
+    node_pool_length = (num + num / 2 + 1) * sizeof(interval_t);
+    reversed_ranges_length = (num / 2 + 1) * sizeof(reversed_range_t);
+    aux = map_auxiliary_memory(length);
+    run_array = map_auxiliary_memory(run_array_length);
+    node_pool.memory = map_auxiliary_memory(node_pool_length);
+    reversed_ranges = map_auxiliary_memory(reversed_ranges_length);
+    
+    if (aux == MAP_FAILED
+        || run_array == MAP_FAILED
+        || node_pool.memory == MAP_FAILED
+        || reversed_ranges == MAP_FAILED)
+    {
+        if (aux != MAP_FAILED)
+        {
+            munmap(aux, length);
+        }
+        
+        if (run_array != MAP_FAILED)
+        {
+            munmap(run_array, run_array_length);
+        }
+        
+        if (node_pool.memory != MAP_FAILED)
+        {
+            munmap(node_pool.memory, node_pool_length);
+        }
+        
+        if (reversed_ranges != MAP_FAILED)
+        {
+            munmap(reversed_ranges, reversed_ranges_length);
+        }
+        
+        munmap(base, length);
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    node_pool.node_size = sizeof(interval_t);
+    node_pool.capacity = num + num / 2 + 1;
+    node_pool.used = 0;
+    node_pool.free_list = NULL;
+    
+    /**********************************************************************
+    * The file is read front to back twice: once when copied to the       *
+    * auxiliary array, and once when the copy-out compares it with the    *
+    * sorted data. All the scanning and merging happens in the anonymous  *
+    * mapping, so the file pages are written only where the data changes. *
+    **********************************************************************/
+    madvise(base, length, MADV_SEQUENTIAL);
+    
+    state = adaptive_sort_state_t_alloc(record_size,
+                                        compare_without_context,
+                                        &compar);
+    state->aux = aux;
+    state->capacity = num;
+    state->node_pool = &node_pool;
+    state->run_queue_builder = run_queue_builder_t_alloc(aux,
+                                                         num,
+                                                         record_size,
+                                                         run_array,
+                                                         state->cmp,
+                                                         state->ctx);
+    state->run_queue_builder->node_pool = &node_pool;
+    state->run_queue_builder->reversed_ranges = reversed_ranges;
+    state->run_queue = state->run_queue_builder->run_queue;
+    state->skip_unchanged_writes = 1;
+    state->page_size = (size_t) sysconf(_SC_PAGESIZE);
+    adaptive_sort_state_t_reset(state, base, num);
+    
+    while (!adaptive_sort_step(state, (size_t) -1))
+    {
+    }
+    
+    /*********************************************************************
+    * The auxiliary array is not owned by the state, so detach it before *
+    * deallocating the state.                                            *
+    *********************************************************************/
+    state->aux = NULL;
+    adaptive_sort_state_t_free(state);
+    munmap(reversed_ranges, reversed_ranges_length);
+    munmap(node_pool.memory, node_pool_length);
+    munmap(run_array, run_array_length);
+    munmap(aux, length);
+    
+    if (msync(base, length, MS_SYNC))
+    {
+        saved_errno = errno;
+        munmap(base, length);
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    munmap(base, length);
+    return close(fd);
 }
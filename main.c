@@ -1,5 +1,424 @@
 #include "net/coderodde/util/AdaptiveMergesort.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CONCURRENT_SORTS 8
+#define CONCURRENT_SORT_LENGTH 100000
+#define CHECK_PATTERNS 4
+#define CHECK_MAX_LENGTH 600
+#define AUTO_CHECK_PATTERNS 4
+#define AUTO_CHECK_LENGTH 10000
+#define AUTO_CHECK_INTERLEAVED_RUNS 100
+#define BATCH_CHECK_ARRAYS 40
+
+/*********************************************************************
+* The context of one concurrent sort: the elements are ordered by    *
+* their remainder modulo 'modulus', and each comparison is counted.  *
+*********************************************************************/
+typedef struct sort_context_t {
+    int modulus;
+    size_t comparisons;
+} sort_context_t;
+
+typedef struct sort_job_t {
+    sort_context_t context;
+    int* array;
+    int ok;
+} sort_job_t;
+
+/***********************************************************************
+* A record for the stability checks: the records are compared by 'key' *
+* only, and 'index' remembers the original position of each record.    *
+***********************************************************************/
+typedef struct record_t {
+    int key;
+    int index;
+} record_t;
+
+int record_cmp(const void* a, const void* b)
+{
+    int aa = ((const record_t*) a)->key;
+    int bb = ((const record_t*) b)->key;
+    return (aa > bb) - (aa < bb);
+}
+
+/************************************************************************
+* Fills 'records' with one of the check patterns: random keys with many *
+* duplicates, ascending, descending with duplicates, and a sawtooth of  *
+* alternating ascending and descending runs.                            *
+************************************************************************/
+void fill_records(record_t* records, size_t num, int pattern, unsigned seed)
+{
+    size_t i;
+    
+    for (i = 0; i < num; ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        records[i].index = (int) i;
+        
+        switch (pattern)
+        {
+            case 0:
+                records[i].key = (int)((seed >> 16) % 32);
+                break;
+                
+            case 1:
+                records[i].key = (int) i;
+                break;
+                
+            case 2:
+                records[i].key = (int)(num - i) / 3;
+                break;
+                
+            default:
+                records[i].key = (i / 20) % 2 ? (int) i : -(int) i;
+                break;
+        }
+    }
+}
+
+/*******************************************************************
+* Returns nonzero if 'records' are sorted by key, and the records  *
+* with equal keys are in their original order.                     *
+*******************************************************************/
+int records_sorted_stably(const record_t* records, size_t num)
+{
+    size_t i;
+    
+    for (i = 1; i < num; ++i)
+    {
+        if (records[i - 1].key > records[i].key
+            || (records[i - 1].key == records[i].key
+                && records[i - 1].index > records[i].index))
+        {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/***********************************************************************
+* Runs the resumable sort with tiny work budgets over all the patterns *
+* and lengths up to CHECK_MAX_LENGTH, and checks the results.          *
+***********************************************************************/
+int run_stepped_sorts(void)
+{
+    record_t records[CHECK_MAX_LENGTH];
+    adaptive_sort_state_t* state;
+    size_t num;
+    size_t budget;
+    int pattern;
+    int ok = 1;
+    
+    for (pattern = 0; pattern < CHECK_PATTERNS; ++pattern)
+    {
+        for (num = 0; num < CHECK_MAX_LENGTH; num += 1 + num / 8)
+        {
+            for (budget = 1; budget <= 5; ++budget)
+            {
+                fill_records(records, num, pattern, (unsigned) num);
+                state = adaptive_sort_begin(records,
+                                            num,
+                                            sizeof(record_t),
+                                            record_cmp);
+                
+                while (!adaptive_sort_step(state, budget))
+                {
+                }
+                
+                adaptive_sort_finish(state);
+                ok &= records_sorted_stably(records, num);
+            }
+        }
+    }
+    
+    printf("stepped sorts: %s\n", ok ? "sorted" : "NOT SORTED");
+    return ok;
+}
+
+/**************************************************************************
+* Runs the bounded-memory sort with buffers of zero and one element over  *
+* all the patterns, so that nearly all the merges go through the SymMerge *
+* rotations, and checks the results. Also checks that presorted input     *
+* allocates no buffer at all.                                             *
+**************************************************************************/
+int run_bounded_sorts(void)
+{
+    record_t records[CHECK_MAX_LENGTH];
+    size_t budgets[] = { 0, sizeof(record_t) };
+    size_t peak_aux_bytes;
+    size_t num;
+    size_t i;
+    int pattern;
+    int ok = 1;
+    
+    for (pattern = 0; pattern < CHECK_PATTERNS; ++pattern)
+    {
+        for (num = 0; num < CHECK_MAX_LENGTH; num += 1 + num / 8)
+        {
+            for (i = 0; i < sizeof budgets / sizeof budgets[0]; ++i)
+            {
+                fill_records(records, num, pattern, (unsigned) num);
+                adaptive_mergesort_bounded(records,
+                                           num,
+                                           sizeof(record_t),
+                                           record_cmp,
+                                           budgets[i],
+                                           &peak_aux_bytes);
+                ok &= records_sorted_stably(records, num);
+                ok &= peak_aux_bytes <= budgets[i];
+                
+                if (pattern == 1)
+                {
+                    ok &= peak_aux_bytes == 0;
+                }
+            }
+        }
+    }
+    
+    printf("bounded sorts: %s\n", ok ? "sorted" : "NOT SORTED");
+    return ok;
+}
+
+/*************************************************************************
+* Runs the batch sort with no threads, one thread, and more threads than *
+* there are arrays. The array lengths lie on both sides of the lengths   *
+* at which the batch sort switches from insertion sort to the ping-pong  *
+* mergesort, 16, and from the ping-pong mergesort to the interval merge, *
+* 256. Checks each array of the batch separately.                        *
+*************************************************************************/
+int run_batch_sorts(void)
+{
+    size_t lengths[] = { 0, 1, 2, 15, 16, 17, 100, 255, 256, 257, 600 };
+    size_t thread_counts[] = { 0, 1, 3, BATCH_CHECK_ARRAYS + 1 };
+    size_t length_count = sizeof lengths / sizeof lengths[0];
+    record_t* arrays[BATCH_CHECK_ARRAYS];
+    void* bases[BATCH_CHECK_ARRAYS];
+    size_t nums[BATCH_CHECK_ARRAYS];
+    size_t t;
+    size_t i;
+    int ok = 1;
+    
+    for (i = 0; i < BATCH_CHECK_ARRAYS; ++i)
+    {
+        nums[i] = lengths[i % length_count];
+        arrays[i] = malloc(sizeof(record_t) * (nums[i] ? nums[i] : 1));
+        bases[i] = arrays[i];
+    }
+    
+    for (t = 0; t < sizeof thread_counts / sizeof thread_counts[0]; ++t)
+    {
+        for (i = 0; i < BATCH_CHECK_ARRAYS; ++i)
+        {
+            fill_records(arrays[i],
+                         nums[i],
+                         (int)(i / length_count) % CHECK_PATTERNS,
+                         (unsigned) i);
+        }
+        
+        adaptive_mergesort_batch(bases,
+                                 nums,
+                                 BATCH_CHECK_ARRAYS,
+                                 sizeof(record_t),
+                                 record_cmp,
+                                 thread_counts[t]);
+        
+        for (i = 0; i < BATCH_CHECK_ARRAYS; ++i)
+        {
+            ok &= records_sorted_stably(arrays[i], nums[i]);
+        }
+    }
+    
+    for (i = 0; i < BATCH_CHECK_ARRAYS; ++i)
+    {
+        free(arrays[i]);
+    }
+    
+    printf("batch sorts: %s\n", ok ? "sorted" : "NOT SORTED");
+    return ok;
+}
+
+/***********************************************************************
+* Maps the key of a record to an unsigned integer in the same order as *
+* 'record_cmp' compares the records.                                   *
+***********************************************************************/
+uint64_t record_key(const void* a)
+{
+    return (uint64_t)((const record_t*) a)->key + 0x80000000u;
+}
+
+/**********************************************************************
+* Fills 'records' with one of the inputs of the automatic sort check: *
+* ascending, strictly descending, AUTO_CHECK_INTERLEAVED_RUNS long    *
+* ascending runs interleaved element by element, and random keys with *
+* many duplicates.                                                    *
+**********************************************************************/
+void fill_auto_records(record_t* records, size_t num, int pattern)
+{
+    unsigned seed = 1;
+    size_t i;
+    
+    for (i = 0; i < num; ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        records[i].index = (int) i;
+        
+        switch (pattern)
+        {
+            case 0:
+                records[i].key = (int) i;
+                break;
+                
+            case 1:
+                records[i].key = (int)(num - i);
+                break;
+                
+            case 2:
+                records[i].key = (int)(i % AUTO_CHECK_INTERLEAVED_RUNS
+                                       * num
+                                       / AUTO_CHECK_INTERLEAVED_RUNS
+                                       + i / AUTO_CHECK_INTERLEAVED_RUNS);
+                break;
+                
+            default:
+                records[i].key = (int)((seed >> 16) % 32);
+                break;
+        }
+    }
+}
+
+/************************************************************************
+* Runs the automatic sort over the inputs of 'fill_auto_records', with  *
+* and without the key function, and checks both the results and the     *
+* chosen strategies: the ascending and the descending inputs must go to *
+* the interval merge, the others to the radix sort or to the plain      *
+* mergesort.                                                            *
+************************************************************************/
+int run_auto_sorts(void)
+{
+    record_t* records = malloc(sizeof(record_t) * AUTO_CHECK_LENGTH);
+    adaptive_sort_strategy_t expected;
+    adaptive_sort_stats_t stats;
+    int pattern;
+    int with_key;
+    int ok = 1;
+    
+    for (pattern = 0; pattern < AUTO_CHECK_PATTERNS; ++pattern)
+    {
+        for (with_key = 0; with_key < 2; ++with_key)
+        {
+            if (pattern < 2)
+            {
+                expected = ADAPTIVE_SORT_INTERVAL_MERGE;
+            }
+            else
+            {
+                expected = with_key ? ADAPTIVE_SORT_RADIX
+                                    : ADAPTIVE_SORT_PING_PONG_MERGE;
+            }
+            
+            fill_auto_records(records, AUTO_CHECK_LENGTH, pattern);
+            adaptive_mergesort_auto(records,
+                                    AUTO_CHECK_LENGTH,
+                                    sizeof(record_t),
+                                    record_cmp,
+                                    with_key ? record_key : NULL,
+                                    &stats);
+            ok &= records_sorted_stably(records, AUTO_CHECK_LENGTH);
+            ok &= stats.strategy == expected;
+        }
+    }
+    
+    free(records);
+    printf("automatic sorts: %s\n", ok ? "sorted" : "NOT SORTED");
+    return ok;
+}
+
+/************************************************************************
+* Writes 'num' records to the file 'fd', sorts the file with            *
+* 'adaptive_mergesort_mmap' at 'path', and checks that it now holds the *
+* same records as 'records' sorted in memory.                           *
+************************************************************************/
+int check_mmap_sort(const char* path,
+                    int fd,
+                    record_t* records,
+                    record_t* sorted,
+                    size_t num)
+{
+    size_t length = num * sizeof(record_t);
+    
+    if (ftruncate(fd, 0)
+        || pwrite(fd, records, length, 0) != (ssize_t) length
+        || adaptive_mergesort_mmap(path, sizeof(record_t), record_cmp)
+        || pread(fd, sorted, length, 0) != (ssize_t) length)
+    {
+        return 0;
+    }
+    
+    adaptive_mergesort(records, num, sizeof(record_t), record_cmp);
+    return records_sorted_stably(sorted, num)
+        && memcmp(records, sorted, length) == 0;
+}
+
+/************************************************************************
+* Sorts temporary files of the inputs of 'fill_auto_records' in place,  *
+* including the ascending and the strictly descending files, whose runs *
+* are left in place and reversed in place. Also checks that the files   *
+* of zero and one record are accepted, and that the invalid record      *
+* sizes are rejected with EINVAL.                                       *
+************************************************************************/
+int run_mmap_sorts(void)
+{
+    char path[] = "/tmp/adaptive_mergesort_XXXXXX";
+    record_t* records = malloc(sizeof(record_t) * AUTO_CHECK_LENGTH);
+    record_t* sorted = malloc(sizeof(record_t) * AUTO_CHECK_LENGTH);
+    int fd = mkstemp(path);
+    size_t num;
+    int pattern;
+    int ok = fd >= 0;
+    
+    for (pattern = 0; ok && pattern < AUTO_CHECK_PATTERNS; ++pattern)
+    {
+        for (num = 0; num < CHECK_MAX_LENGTH; num += 1 + num / 8)
+        {
+            fill_auto_records(records, num, pattern);
+            ok &= check_mmap_sort(path, fd, records, sorted, num);
+        }
+        
+        fill_auto_records(records, AUTO_CHECK_LENGTH, pattern);
+        ok &= check_mmap_sort(path,
+                              fd,
+                              records,
+                              sorted,
+                              AUTO_CHECK_LENGTH);
+    }
+    
+    if (fd >= 0)
+    {
+        errno = 0;
+        ok &= adaptive_mergesort_mmap(path, 0, record_cmp) == -1
+           && errno == EINVAL;
+        
+        errno = 0;
+        ok &= ftruncate(fd, 3 * sizeof(record_t) + 1) == 0
+           && adaptive_mergesort_mmap(path,
+                                      sizeof(record_t),
+                                      record_cmp) == -1
+           && errno == EINVAL;
+        
+        close(fd);
+        unlink(path);
+    }
+    
+    free(sorted);
+    free(records);
+    printf("mmap sorts: %s\n", ok ? "sorted" : "NOT SORTED");
+    return ok;
+}
 
 int my_cmp(const void* a, const void* b)
 {
@@ -15,6 +434,79 @@ int my_cmp(const void* a, const void* b)
     return (int)(a - b);
 }
 
+int modulus_cmp(const void* a, const void* b, void* ctx)
+{
+    sort_context_t* context = ctx;
+    int aa = *(const int*) a % context->modulus;
+    int bb = *(const int*) b % context->modulus;
+    
+    context->comparisons++;
+    return (aa > bb) - (aa < bb);
+}
+
+void* sort_job_run(void* arg)
+{
+    sort_job_t* job = arg;
+    size_t i;
+    
+    for (i = 0; i < CONCURRENT_SORT_LENGTH; ++i)
+    {
+        job->array[i] = (int)((i * 2654435761u) % 1000003);
+    }
+    
+    adaptive_mergesort_r(job->array,
+                         CONCURRENT_SORT_LENGTH,
+                         sizeof(int),
+                         modulus_cmp,
+                         &job->context);
+    
+    job->ok = 1;
+    
+    for (i = 1; i < CONCURRENT_SORT_LENGTH; ++i)
+    {
+        if (job->array[i - 1] % job->context.modulus
+            > job->array[i] % job->context.modulus)
+        {
+            job->ok = 0;
+        }
+    }
+    
+    return NULL;
+}
+
+/*************************************************************************
+* Runs several sorts concurrently, each with its own comparator context, *
+* and checks that each one is sorted by its own modulus.                 *
+*************************************************************************/
+int run_concurrent_sorts(void)
+{
+    pthread_t threads[CONCURRENT_SORTS];
+    sort_job_t jobs[CONCURRENT_SORTS];
+    int ok = 1;
+    int i;
+    
+    for (i = 0; i < CONCURRENT_SORTS; ++i)
+    {
+        jobs[i].context.modulus = 10 + 100 * i;
+        jobs[i].context.comparisons = 0;
+        jobs[i].array = malloc(sizeof(int) * CONCURRENT_SORT_LENGTH);
+        pthread_create(&threads[i], NULL, sort_job_run, &jobs[i]);
+    }
+    
+    for (i = 0; i < CONCURRENT_SORTS; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        printf("modulus %d: %s, %zu comparisons\n",
+               jobs[i].context.modulus,
+               jobs[i].ok ? "sorted" : "NOT SORTED",
+               jobs[i].context.comparisons);
+        ok &= jobs[i].ok;
+        free(jobs[i].array);
+    }
+    
+    return ok;
+}
+
 int main(int argc, const char * argv[]) {
     int* a1 = malloc(sizeof(int)); *a1 = 1;
     int* a2 = malloc(sizeof(int)); *a2 = 2;
@@ -36,5 +528,11 @@ int main(int argc, const char * argv[]) {
     /*int* arr2[] = { a1, a1, a2, a4, a4, a5 };
     void* yeah = lower_bound(arr2, 5, sizeof(int*), &a4, my_cmp);
     printf("%d\n", **(int**)(yeah));*/
-    return 0;
+    puts("");
+    return run_concurrent_sorts()
+         & run_stepped_sorts()
+         & run_bounded_sorts()
+         & run_batch_sorts()
+         & run_auto_sorts()
+         & run_mmap_sorts() ? 0 : 1;
 }
@@ -1,6 +1,7 @@
 #ifndef NET_CODERODDE_UTIL_ADAPTIVE_MERGESORT_H
 #define NET_CODERODDE_UTIL_ADAPTIVE_MERGESORT_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 void adaptive_mergesort(void* base,
@@ -8,4 +9,119 @@ void adaptive_mergesort(void* base,
                         size_t size,
                         int (*compar)(const void*, const void*));
 
+/*************************************************************************
+* Same as 'adaptive_mergesort', but passes 'ctx' as the third argument   *
+* to every call of 'compar'. The sort keeps no state outside of its own  *
+* allocations, so any number of sorts may run concurrently.              *
+*************************************************************************/
+void adaptive_mergesort_r(void* base,
+                          size_t num,
+                          size_t size,
+                          int (*compar)(const void*, const void*, void*),
+                          void* ctx);
+
+/******************************************************************************
+* A resumable sort. 'adaptive_sort_begin' sets up the sort without touching   *
+* the data, each call to 'adaptive_sort_step' performs approximately at most  *
+* 'work_budget' comparisons and element moves and returns nonzero once 'base' *
+* is sorted, and 'adaptive_sort_finish' completes any remaining work and      *
+* releases the state. 'base' is not modified until the last phase of the      *
+* sort, when the sorted data is copied back.                                  *
+******************************************************************************/
+typedef struct adaptive_sort_state_t adaptive_sort_state_t;
+
+adaptive_sort_state_t* adaptive_sort_begin(void* base,
+                                           size_t num,
+                                           size_t size,
+                                           int (*compar)(const void*,
+                                                         const void*));
+
+adaptive_sort_state_t* adaptive_sort_begin_r(void* base,
+                                             size_t num,
+                                             size_t size,
+                                             int (*compar)(const void*,
+                                                           const void*,
+                                                           void*),
+                                             void* ctx);
+
+int adaptive_sort_step(adaptive_sort_state_t* state, size_t work_budget);
+
+void adaptive_sort_finish(adaptive_sort_state_t* state);
+
+/****************************************************************************
+* Sorts the 'count' independent arrays 'bases[i]' of 'nums[i]' elements     *
+* each, using up to 'nthreads' threads. The arrays are split between the    *
+* threads by their total size, and each thread reuses one workspace for all *
+* of its arrays. Arrays of up to a few hundred elements are sorted without  *
+* allocating any memory.                                                    *
+****************************************************************************/
+void adaptive_mergesort_batch(void** bases,
+                              const size_t* nums,
+                              size_t count,
+                              size_t size,
+                              int (*compar)(const void*, const void*),
+                              size_t nthreads);
+
+/***************************************************************************
+* The strategies 'adaptive_mergesort_auto' may choose from, and the        *
+* presortedness estimates the choice was based on. 'sampled_run_length' is *
+* the mean length of the runs in the sampled windows, 'inversion_ratio' is *
+* the fraction of sampled pairs that are out of order with respect to the  *
+* direction of the sampled runs, so a descending input counts as sorted.   *
+***************************************************************************/
+typedef enum adaptive_sort_strategy_t {
+    ADAPTIVE_SORT_INTERVAL_MERGE,
+    ADAPTIVE_SORT_PING_PONG_MERGE,
+    ADAPTIVE_SORT_RADIX
+} adaptive_sort_strategy_t;
+
+typedef struct adaptive_sort_stats_t {
+    adaptive_sort_strategy_t strategy;
+    double sampled_run_length;
+    double inversion_ratio;
+} adaptive_sort_stats_t;
+
+/****************************************************************************
+* Samples the presortedness of the input and sorts it by the interval merge *
+* if both the sampled runs are long and few of the sampled pairs are out of *
+* order. Otherwise sorts it by a radix sort if 'key' is not NULL, or by a   *
+* plain mergesort if it is. 'key' must map the elements to unsigned         *
+* integers in the same order as 'compar' does. If 'stats' is not NULL, the  *
+* chosen strategy and the estimates are stored in it. All the strategies    *
+* are stable.                                                               *
+****************************************************************************/
+void adaptive_mergesort_auto(void* base,
+                             size_t num,
+                             size_t size,
+                             int (*compar)(const void*, const void*),
+                             uint64_t (*key)(const void*),
+                             adaptive_sort_stats_t* stats);
+
+/**************************************************************************
+* Sorts 'base' in place, using at most 'max_aux_bytes' bytes of auxiliary *
+* heap memory. Natural runs are merged through the auxiliary buffer when  *
+* the shorter of the two fits in it, and by rotations otherwise. If       *
+* 'peak_aux_bytes' is not NULL, the actual peak auxiliary heap usage is   *
+* stored in it. Stable.                                                   *
+**************************************************************************/
+void adaptive_mergesort_bounded(void* base,
+                                size_t num,
+                                size_t size,
+                                int (*compar)(const void*, const void*),
+                                size_t max_aux_bytes,
+                                size_t* peak_aux_bytes);
+
+/************************************************************************
+* Sorts the file at 'path' in place as an array of records of           *
+* 'record_size' bytes. The file is memory-mapped and sorted through an  *
+* anonymous auxiliary mapping of the same size. Only the pages whose    *
+* contents change are written back, so on presorted files the writeback *
+* I/O is proportional to the disorder. Returns 0 on success, or -1 with *
+* 'errno' set on failure. The length of the file must be a multiple of  *
+* 'record_size'.                                                        *
+************************************************************************/
+int adaptive_mergesort_mmap(const char* path,
+                            size_t record_size,
+                            int (*compar)(const void*, const void*));
+
 #endif /* NET_CODERODDE_UTIL_ADAPTIVE_MERGESORT_H */